@@ -0,0 +1,162 @@
+#pragma once
+/*
+* Covariant Script: Bytecode
+* This program is based on Covariant Mozart.
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+* Copyright (C) 2017 Michael Lee(李登淳)
+* Email: mikecovlee@163.com
+* Github: https://github.com/mikecovlee
+*
+* Version: 1.0.0
+*/
+#include "./core.hpp"
+#include <unordered_map>
+#include <fstream>
+#include <cstring>
+#if defined(__unix__)||defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define CS_BYTECODE_MMAP
+#endif
+
+namespace cs {
+// Bytecode Format Version
+	constexpr std::uint32_t bytecode_version=1;
+	constexpr std::uint32_t bytecode_byte_order=0x01020304;
+// Bytecode File Header
+	struct bytecode_header final {
+		char magic[4]= {'C','S','B','C'};
+		std::uint32_t version=bytecode_version;
+		std::uint32_t byte_order=bytecode_byte_order;
+		std::uint32_t record_size=sizeof(instruction_record);
+		std::uint64_t record_offset=0;
+		std::uint64_t record_count=0;
+		std::uint64_t symbol_offset=0;
+		std::uint64_t symbol_count=0;
+	};
+	class calc_registry final {
+		static std::unordered_map<std::string,calc_function>& functions()
+		{
+			static std::unordered_map<std::string,calc_function> map;
+			return map;
+		}
+	public:
+		static void add(const std::string& name,calc_function func)
+		{
+			if(func==nullptr)
+				throw lang_error("CSLE0008");
+			functions()[name]=func;
+		}
+		static calc_function find(const std::string& name)
+		{
+			auto it=functions().find(name);
+			if(it==functions().end())
+				throw lang_error("CSLE0011");
+			return it->second;
+		}
+		static const std::string& name_of(calc_function func)
+		{
+			for(auto& it:functions())
+				if(it.second==func)
+					return it.first;
+			throw lang_error("CSLE0011");
+		}
+	};
+	inline void save_bytecode(const code_object& code,const std::string& path)
+	{
+		bytecode_header header;
+		header.record_offset=(sizeof(bytecode_header)+7)/8*8;
+		header.record_count=code.size();
+		header.symbol_offset=header.record_offset+code.size()*sizeof(instruction_record);
+		header.symbol_count=code.calcs().size();
+		for(std::size_t i=0; i<code.size(); ++i)
+			if(code.records()[i].op==opcode::invoke)
+				throw lang_error("CSLE0012");
+		std::ofstream out(path,std::ios::binary|std::ios::trunc);
+		if(!out)
+			throw lang_error("CSLE0013");
+		out.write(reinterpret_cast<const char*>(&header),sizeof(header));
+		for(std::size_t i=sizeof(header); i<header.record_offset; ++i)
+			out.put(0);
+		out.write(reinterpret_cast<const char*>(code.records()),code.size()*sizeof(instruction_record));
+		for(std::size_t i=0; i<code.calcs().size(); ++i) {
+			const std::string& name=calc_registry::name_of(code.calcs().get(i));
+			std::uint32_t length=name.size();
+			out.write(reinterpret_cast<const char*>(&length),sizeof(length));
+			out.write(name.data(),length);
+		}
+		if(!out)
+			throw lang_error("CSLE0013");
+	}
+	inline code_pointer load_bytecode(const std::string& path)
+	{
+		std::shared_ptr<const void> image;
+		std::size_t size=0;
+#ifdef CS_BYTECODE_MMAP
+		int fd=::open(path.c_str(),O_RDONLY);
+		if(fd<0)
+			throw lang_error("CSLE0013");
+		struct stat info;
+		if(::fstat(fd,&info)!=0||info.st_size==0) {
+			::close(fd);
+			throw lang_error("CSLE0013");
+		}
+		size=info.st_size;
+		void* addr=::mmap(nullptr,size,PROT_READ,MAP_PRIVATE,fd,0);
+		::close(fd);
+		if(addr==MAP_FAILED)
+			throw lang_error("CSLE0013");
+		image=std::shared_ptr<const void>(addr,[size](const void* ptr) {
+			::munmap(const_cast<void*>(ptr),size);
+		});
+#else
+		std::ifstream in(path,std::ios::binary|std::ios::ate);
+		if(!in)
+			throw lang_error("CSLE0013");
+		size=in.tellg();
+		std::shared_ptr<std::uint64_t> buffer(new std::uint64_t[(size+7)/8],std::default_delete<std::uint64_t[]>());
+		in.seekg(0);
+		if(!in.read(reinterpret_cast<char*>(buffer.get()),size))
+			throw lang_error("CSLE0013");
+		image=buffer;
+#endif
+		const char* base=static_cast<const char*>(image.get());
+		bytecode_header header;
+		if(size<sizeof(header))
+			throw lang_error("CSLE0014");
+		std::memcpy(&header,base,sizeof(header));
+		if(std::memcmp(header.magic,"CSBC",4)!=0||header.version!=bytecode_version||header.byte_order!=bytecode_byte_order||header.record_size!=sizeof(instruction_record))
+			throw lang_error("CSLE0014");
+		if(header.record_offset%alignof(instruction_record)!=0||header.record_offset>size||header.record_count>(size-header.record_offset)/sizeof(instruction_record)||header.symbol_offset>size)
+			throw lang_error("CSLE0014");
+		calc_table calcs;
+		for(std::size_t i=0,posit=header.symbol_offset; i<header.symbol_count; ++i) {
+			std::uint32_t length=0;
+			if(size-posit<sizeof(length))
+				throw lang_error("CSLE0014");
+			std::memcpy(&length,base+posit,sizeof(length));
+			posit+=sizeof(length);
+			if(size-posit<length)
+				throw lang_error("CSLE0014");
+			if(calcs.add(calc_registry::find(std::string(base+posit,length)))!=i)
+				throw lang_error("CSLE0014");
+			posit+=length;
+		}
+		return std::make_shared<const code_object>(image,reinterpret_cast<const instruction_record*>(base+header.record_offset),header.record_count,calcs);
+	}
+}
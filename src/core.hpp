@@ -25,39 +25,190 @@
 #include <string>
 #include <deque>
 #include <list>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <exception>
+#include <algorithm>
+#include <limits>
+#include <cstdint>
 #include "./exceptions.hpp"
 #include "./memory.hpp"
 #include "./var.hpp"
+#include "./timer.hpp"
+#include "./profile.hpp"
+#include <unordered_map>
 namespace cs {
-// Type definition
-	using integer=long;
-	using floating=long double;
-	using character=char;
-	using boolean=bool;
-	using literal=std::string;
 // Version
 	const literal version="1.0.0";
 // Memory Pool
-	constexpr std::size_t var_pool_size=10240;
+	// Vars per segment, the var pool has no cap and grows by one segment at a time
+	constexpr std::size_t var_segment_size=1024;
 	constexpr std::size_t thread_pool_size=1024;
+	// Registers a code object may address, records naming a higher one are rejected
+	constexpr std::size_t register_limit=65536;
+	using var_storage=cov::storage<var,var_segment_size,var_backing>;
+	using var_pointer=var_storage::pointer;
+// Tracing Support
+	class var_tracer final {
+		friend class virtual_machine;
+		var_storage& mPool;
+		std::vector<var_pointer>& mGray;
+		std::size_t mMarked=0;
+		var_tracer(var_storage& pool,std::vector<var_pointer>& gray):mPool(pool),mGray(gray) {}
+	public:
+		void mark(const var_pointer& vptr)
+		{
+			if(mPool.mark(vptr)) {
+				mGray.push_back(vptr);
+				++mMarked;
+			}
+		}
+	};
+	template<>struct trace_helper<var_pointer> {
+		static void trace(const var_pointer& vptr,var_tracer& t)
+		{
+			t.mark(vptr);
+		}
+	};
+// Calculate Function Type
+	using calc_function=bool(*)(var&,const var&,const var&);
 // Classes definition
 // Instruction Enumerations
 	enum class instruction_type {
 		calc,tag,jump,jict,jicf,call,join
 	};
+// Lowered Opcode Enumerations
+	enum class opcode : std::uint8_t {
+		invoke,calc,tag,jump,jict,jicf,calc_jump,calc_jict,calc_jicf
+	};
+	inline const char* opcode_name(opcode op) noexcept
+	{
+		static const char* names[]= {"invoke","calc","tag","jump","jict","jicf","calc_jump","calc_jict","calc_jicf"};
+		return op<=opcode::calc_jicf?names[static_cast<std::size_t>(op)]:"unknown";
+	}
 // Thread Status Enumerations
 	enum class thread_status {
 		ready,busy,idle,finish
 	};
+// Collector Phase Enumerations
+	enum class gc_phase {
+		idle,mark,sweep
+	};
+// Instruction Record Structure
+	struct instruction_record;
+// Calculate Function Table Class
+	class calc_table;
+// Thread Statistics Structure
+	struct thread_stats;
+// Memory Report Structure
+	struct memory_report;
 // Instruction Base Class
 	class instruction_base;
 // Compiler Class
 	class compiler;
+// Code Object Class
+	class code_object;
 // Thread Class
 	class thread;
 // Virtual Machine Class
 	class virtual_machine;
+// Wait Queue Class
+	class wait_queue;
 // Classes Realization
+	struct instruction_record final {
+		opcode op=opcode::invoke;
+		std::uint8_t reserved[3]= {0,0,0};
+		std::uint32_t operand=0;
+		std::uint32_t func=0;
+		std::uint32_t dst=0;
+		std::uint32_t lhs=0;
+		std::uint32_t rhs=0;
+	};
+	static_assert(sizeof(instruction_record)==24,"CSLE0009");
+	class calc_table final {
+		std::vector<calc_function> mFuncs;
+	public:
+		std::uint32_t add(calc_function func)
+		{
+			for(std::size_t i=0; i<mFuncs.size(); ++i)
+				if(mFuncs[i]==func)
+					return i;
+			mFuncs.push_back(func);
+			return mFuncs.size()-1;
+		}
+		calc_function get(std::uint32_t idx) const
+		{
+			if(idx>=mFuncs.size())
+				throw lang_error("CSLE0010");
+			return mFuncs[idx];
+		}
+		const calc_function* data() const noexcept
+		{
+			return mFuncs.data();
+		}
+		std::size_t size() const noexcept
+		{
+			return mFuncs.size();
+		}
+	};
+	struct thread_stats final {
+		std::size_t slices=0;
+		std::size_t instructions=0;
+		cov::timer::timer_t total_latency=0;
+		cov::timer::timer_t max_latency=0;
+	};
+	struct memory_report final {
+		cov::storage_stats var_pool;
+		std::vector<cov::slab_stats> slabs;
+		std::vector<holder_stats> holders;
+		std::vector<cov::allocator_stats> allocators;
+		std::size_t shared_control_blocks=0;
+		cov::huge_page_stats huge_pages;
+		std::string to_string() const
+		{
+			std::string str="Var Pool:\n";
+			str+="  segments="+std::to_string(var_pool.segments)+"\tcapacity="+std::to_string(var_pool.capacity)+"\tsize="+std::to_string(var_pool.size)+"\tpeak="+std::to_string(var_pool.peak)+"\tfree="+std::to_string(var_pool.free)+"\n";
+			str+="Slabs:\n";
+			for(auto& s:slabs)
+				str+="  block_size="+std::to_string(s.block_size)+"\tslabs="+std::to_string(s.slab_count)+"\tcapacity="+std::to_string(s.capacity)+"\tuntouched="+std::to_string(s.untouched)+"\tfree="+std::to_string(s.free)+"\toutstanding="+std::to_string(s.outstanding)+"\n";
+			str+="Holders:\n";
+			for(auto& h:holders)
+				str+="  "+h.type+"\tsize="+std::to_string(h.holder_size)+"\tlive="+std::to_string(h.live)+"\n";
+			str+="Allocators:\n";
+			for(auto& a:allocators)
+				str+="  "+a.type+"\tblock_size="+std::to_string(a.block_size)+"\toffset="+std::to_string(a.offset)+"\thits="+std::to_string(a.hits)+"\tmisses="+std::to_string(a.misses)+"\thit_rate="+std::to_string(a.hit_rate())+"\n";
+			str+="Shared Control Blocks: "+std::to_string(shared_control_blocks)+"\n";
+			str+="Huge Pages:\n  reserved="+std::to_string(huge_pages.reserved)+"\tused="+std::to_string(huge_pages.used)+"\tcached="+std::to_string(huge_pages.cached)+"\tfallback="+std::to_string(huge_pages.fallback)+"\tadvised="+(huge_pages.advised?"true":"false")+"\n";
+			return str;
+		}
+		std::string to_json() const
+		{
+			std::string str="{\"var_pool\":{\"segments\":"+std::to_string(var_pool.segments)+",\"capacity\":"+std::to_string(var_pool.capacity)+",\"size\":"+std::to_string(var_pool.size)+",\"peak\":"+std::to_string(var_pool.peak)+",\"free\":"+std::to_string(var_pool.free)+"},\"slabs\":[";
+			for(std::size_t i=0; i<slabs.size(); ++i) {
+				if(i!=0)
+					str+=",";
+				str+="{\"block_size\":"+std::to_string(slabs[i].block_size)+",\"slabs\":"+std::to_string(slabs[i].slab_count)+",\"capacity\":"+std::to_string(slabs[i].capacity)+",\"untouched\":"+std::to_string(slabs[i].untouched)+",\"free\":"+std::to_string(slabs[i].free)+",\"outstanding\":"+std::to_string(slabs[i].outstanding)+"}";
+			}
+			str+="],\"holders\":[";
+			for(std::size_t i=0; i<holders.size(); ++i) {
+				if(i!=0)
+					str+=",";
+				str+="{\"type\":\""+holders[i].type+"\",\"size\":"+std::to_string(holders[i].holder_size)+",\"live\":"+std::to_string(holders[i].live)+"}";
+			}
+			str+="],\"allocators\":[";
+			for(std::size_t i=0; i<allocators.size(); ++i) {
+				if(i!=0)
+					str+=",";
+				str+="{\"type\":\""+allocators[i].type+"\",\"block_size\":"+std::to_string(allocators[i].block_size)+",\"offset\":"+std::to_string(allocators[i].offset)+",\"hits\":"+std::to_string(allocators[i].hits)+",\"misses\":"+std::to_string(allocators[i].misses)+"}";
+			}
+			str+="],\"shared_control_blocks\":"+std::to_string(shared_control_blocks);
+			str+=",\"huge_pages\":{\"reserved\":"+std::to_string(huge_pages.reserved)+",\"used\":"+std::to_string(huge_pages.used)+",\"cached\":"+std::to_string(huge_pages.cached)+",\"fallback\":"+std::to_string(huge_pages.fallback)+",\"advised\":"+(huge_pages.advised?"true":"false")+"}";
+			return str+"}";
+		}
+	};
 	class instruction_base {
 	public:
 		instruction_base()=default;
@@ -65,14 +216,261 @@ namespace cs {
 		virtual ~instruction_base()=default;
 		virtual instruction_type type() const=0;
 		virtual void exec(virtual_machine*,thread*) const=0;
+		virtual bool lower(instruction_record&,calc_table&) const
+		{
+			return false;
+		}
 	};
-	class thread final {
-		thread_status mStatus=thread_status::ready;
+	inline std::vector<instruction_record> lower_instructions(const std::deque<instruction_base*>& ins,calc_table& calcs)
+	{
+		std::vector<instruction_record> code(ins.size());
+		for(std::size_t i=0; i<ins.size(); ++i) {
+			if(!ins[i]->lower(code[i],calcs)) {
+				code[i].op=opcode::invoke;
+				code[i].operand=i;
+			}
+		}
+		return code;
+	}
+	inline bool is_branch(opcode op) noexcept
+	{
+		return op==opcode::jump||op==opcode::jict||op==opcode::jicf||op==opcode::calc_jump||op==opcode::calc_jict||op==opcode::calc_jicf;
+	}
+	inline std::uint32_t thread_target(const std::vector<instruction_record>& code,std::uint32_t target)
+	{
+		for(std::size_t steps=0; target<code.size()&&steps<code.size(); ++steps) {
+			if(code[target].op==opcode::tag)
+				++target;
+			else if(code[target].op==opcode::jump)
+				target=code[target].operand;
+			else
+				break;
+		}
+		return target;
+	}
+	inline void optimize_instructions(std::vector<instruction_record>& code,std::vector<std::size_t>& index_map)
+	{
+		bool fusible=true;
+		std::vector<bool> targeted(code.size()+1,false);
+		for(auto& rec:code) {
+			if(rec.op==opcode::invoke)
+				fusible=false;
+			else if(is_branch(rec.op)) {
+				rec.operand=std::min<std::size_t>(thread_target(code,rec.operand),code.size());
+				targeted[rec.operand]=true;
+			}
+		}
+		std::vector<instruction_record> optimized;
+		optimized.reserve(code.size());
+		index_map.assign(code.size()+1,0);
+		for(std::size_t i=0; i<code.size(); ++i) {
+			index_map[i]=optimized.size();
+			if(code[i].op==opcode::tag)
+				continue;
+			optimized.push_back(code[i]);
+			if(fusible&&code[i].op==opcode::calc&&i+1<code.size()&&!targeted[i+1]) {
+				instruction_record& rec=optimized.back();
+				switch(code[i+1].op) {
+				case opcode::jump:
+					rec.op=opcode::calc_jump;
+					break;
+				case opcode::jict:
+					rec.op=opcode::calc_jict;
+					break;
+				case opcode::jicf:
+					rec.op=opcode::calc_jicf;
+					break;
+				default:
+					continue;
+				}
+				rec.operand=code[i+1].operand;
+				index_map[++i]=optimized.size()-1;
+			}
+		}
+		index_map[code.size()]=optimized.size();
+		for(auto& rec:optimized) {
+			if(is_branch(rec.op))
+				rec.operand=index_map[rec.operand];
+		}
+		code.swap(optimized);
+	}
+	class code_object final {
 		const std::deque<instruction_base*> mIns;
+		calc_table mCalcs;
+		std::vector<instruction_record> mRecords;
+		std::shared_ptr<const void> mImage;
+		const instruction_record* mData=nullptr;
+		std::size_t mSize=0;
+		std::vector<std::size_t> mIndexMap;
+		std::size_t mRegCount=0;
+#ifdef CS_PROFILE
+		std::unique_ptr<profile_counter[]> mProfile;
+#endif
+		void analyze()
+		{
+#ifdef CS_PROFILE
+			mProfile.reset(new profile_counter[mSize]);
+#endif
+			for(std::size_t i=0; i<mSize; ++i) {
+				const instruction_record& rec=mData[i];
+				if(rec.op==opcode::calc||rec.op==opcode::calc_jump||rec.op==opcode::calc_jict||rec.op==opcode::calc_jicf) {
+					std::size_t regs=std::size_t(std::max({rec.dst,rec.lhs,rec.rhs}))+1;
+					if(rec.func>=mCalcs.size()||regs>register_limit)
+						throw lang_error("CSLE0010");
+					mRegCount=std::max(mRegCount,regs);
+				}
+				else if(rec.op==opcode::invoke&&rec.operand>=mIns.size())
+					throw lang_error("CSLE0010");
+				else if(rec.op>opcode::calc_jicf)
+					throw lang_error("CSLE0010");
+			}
+		}
+	public:
+		code_object()=delete;
+		code_object(const std::deque<instruction_base*>& ins,bool optimize=false):mIns(ins),mRecords(lower_instructions(ins,mCalcs))
+		{
+			if(optimize)
+				optimize_instructions(mRecords,mIndexMap);
+			mData=mRecords.data();
+			mSize=mRecords.size();
+			analyze();
+		}
+		code_object(const std::shared_ptr<const void>& image,const instruction_record* records,std::size_t size,const calc_table& calcs):mCalcs(calcs),mImage(image),mData(records),mSize(size)
+		{
+			analyze();
+		}
+		code_object(const code_object&)=delete;
+		~code_object()=default;
+		std::size_t size() const noexcept
+		{
+			return mSize;
+		}
+		const instruction_record* records() const noexcept
+		{
+			return mData;
+		}
+		const calc_table& calcs() const noexcept
+		{
+			return mCalcs;
+		}
+		const instruction_base* instruction(std::size_t idx) const
+		{
+			return mIns[idx];
+		}
+		std::size_t register_count() const noexcept
+		{
+			return mRegCount;
+		}
+#ifdef CS_PROFILE
+		profile_counter& profile(std::size_t idx) const noexcept
+		{
+			return mProfile[idx];
+		}
+#endif
+		std::size_t translate(std::size_t line) const noexcept
+		{
+			return mIndexMap.empty()?line:mIndexMap[std::min(line,mIndexMap.size()-1)];
+		}
+	};
+	using code_pointer=std::shared_ptr<const code_object>;
+	class thread final {
+		friend class virtual_machine;
+		struct register_slot final {
+			var_pointer handle;
+			var* data;
+		};
+		std::atomic<thread_status> mStatus {thread_status::ready};
+		const code_pointer mCode;
 		std::size_t mPosit=1;
+		bool mCond=false;
+		bool mYield=false;
+		bool mParked=false;
+		std::list<std::shared_ptr<thread>>::iterator mParkPosit;
+		std::vector<register_slot> mRegs;
+		thread_stats mStats;
+		cov::timer::timer_t mLastRun=0;
+		// Temporaries of this thread, released in bulk when a frame is popped or the thread finishes.
+		// Made on first use and dropped at the end, so threads without temporaries stay small
+		std::unique_ptr<cov::arena> mArena;
+		std::vector<cov::arena::mark> mFrames;
+		// Function-local so that every translation unit including this header shares one slot
+		static thread*& current_slot() noexcept
+		{
+			static thread_local thread* th=nullptr;
+			return th;
+		}
+		class current_guard final {
+			thread* mPrev;
+		public:
+			current_guard(thread* th):mPrev(current_slot())
+			{
+				current_slot()=th;
+			}
+			~current_guard()
+			{
+				current_slot()=mPrev;
+			}
+		};
+		void release_temps()
+		{
+			if(mArena!=nullptr&&!mArena->empty())
+				mFrames.clear();
+			mArena.reset();
+		}
+		void dispatch(virtual_machine* vm,const instruction_record& rec,const calc_function* calcs)
+		{
+			switch(rec.op) {
+			case opcode::invoke:
+				mCode->instruction(rec.operand)->exec(vm,this);
+				break;
+			case opcode::calc:
+				mCond=calcs[rec.func](*mRegs[rec.dst].data,*mRegs[rec.lhs].data,*mRegs[rec.rhs].data);
+				break;
+			case opcode::jump:
+				mPosit=rec.operand;
+				break;
+			case opcode::jict:
+				if(mCond)
+					mPosit=rec.operand;
+				break;
+			case opcode::jicf:
+				if(!mCond)
+					mPosit=rec.operand;
+				break;
+			case opcode::calc_jump:
+				mCond=calcs[rec.func](*mRegs[rec.dst].data,*mRegs[rec.lhs].data,*mRegs[rec.rhs].data);
+				mPosit=rec.operand;
+				break;
+			case opcode::calc_jict:
+				if((mCond=calcs[rec.func](*mRegs[rec.dst].data,*mRegs[rec.lhs].data,*mRegs[rec.rhs].data)))
+					mPosit=rec.operand;
+				break;
+			case opcode::calc_jicf:
+				if(!(mCond=calcs[rec.func](*mRegs[rec.dst].data,*mRegs[rec.lhs].data,*mRegs[rec.rhs].data)))
+					mPosit=rec.operand;
+				break;
+			default:
+				break;
+			}
+		}
+		void step(virtual_machine* vm,const instruction_record* code,const calc_function* calcs)
+		{
+#ifdef CS_PROFILE
+			std::size_t idx=mPosit-1;
+			cov::timer::timer_t begin=cov::timer::time(cov::timer::time_unit::nano_sec);
+			dispatch(vm,code[idx],calcs);
+			mCode->profile(idx).record(cov::timer::time(cov::timer::time_unit::nano_sec)-begin);
+#else
+			dispatch(vm,code[mPosit-1],calcs);
+#endif
+		}
 	public:
 		thread()=delete;
-		thread(const std::deque<instruction_base*>& ins):mIns(ins) {}
+		thread(const code_pointer& code):mCode(code)
+		{
+			if(mCode->size()==0)
+				mStatus=thread_status::finish;
+		}
 		thread(const thread&)=delete;
 		~thread()=default;
 		void set_status(thread_status status) noexcept
@@ -83,73 +481,886 @@ namespace cs {
 		{
 			return mStatus;
 		}
+		void set_condition(bool cond) noexcept
+		{
+			mCond=cond;
+		}
+		bool get_condition() const noexcept
+		{
+			return mCond;
+		}
+		const thread_stats& get_stats() const noexcept
+		{
+			return mStats;
+		}
+		std::size_t register_count() const noexcept
+		{
+			return mRegs.size();
+		}
+		var& get_register(std::size_t idx)
+		{
+			if(idx>=mRegs.size())
+				throw lang_error("CSLE0007");
+			return *mRegs[idx].data;
+		}
 		void jump(std::size_t line)
 		{
-			mPosit=line;
+			mPosit=mCode->translate(line);
+		}
+		// The thread whose instructions are running on this OS thread, for calc functions that make temporaries
+		static thread* current() noexcept
+		{
+			return current_slot();
+		}
+		cov::arena& get_arena()
+		{
+			if(mArena==nullptr)
+				mArena.reset(new cov::arena);
+			return *mArena;
+		}
+		// A frame pushed before the arena exists marks its empty start
+		void push_frame()
+		{
+			mFrames.push_back(mArena!=nullptr?mArena->get_mark():cov::arena::mark {nullptr,nullptr,nullptr});
+		}
+		void pop_frame()
+		{
+			if(mFrames.empty())
+				throw lang_error("CSLE0015");
+			if(mArena!=nullptr)
+				mArena->rewind(mFrames.back());
+			mFrames.pop_back();
+		}
+		void yield() noexcept
+		{
+			mYield=true;
+		}
+		void begin_slice(cov::timer::timer_t now) noexcept
+		{
+			if(mLastRun!=0) {
+				cov::timer::timer_t latency=now-mLastRun;
+				mStats.total_latency+=latency;
+				if(latency>mStats.max_latency)
+					mStats.max_latency=latency;
+			}
+		}
+		void end_slice(cov::timer::timer_t now) noexcept
+		{
+			mLastRun=now;
 		}
 		void call(virtual_machine* vm)
 		{
 			if(mStatus!=thread_status::ready)
 				throw cs::lang_error("CSLE0001");
-			for(; mPosit-1<mIns.size(); ++mPosit)
-				mIns.at(mPosit-1)->exec(vm,this);
+			current_guard guard(this);
+			const calc_function* calcs=mCode->calcs().data();
+			for(const instruction_record* code=mCode->records(); mPosit-1<mCode->size(); ++mPosit)
+				step(vm,code,calcs);
 			mPosit=0;
+			release_temps();
 		}
-		void exec(virtual_machine* vm)
+		std::size_t exec(virtual_machine* vm,std::size_t quantum=1)
 		{
 			if(mStatus==thread_status::finish)
 				throw cs::lang_error("CSLE0002");
-			mIns.at(mPosit-1)->exec(vm,this);
-			if(++mPosit-1>=mIns.size())
-				mStatus=thread_status::finish;
+			const instruction_record* code=mCode->records();
+			const calc_function* calcs=mCode->calcs().data();
+			const std::size_t size=mCode->size();
+			std::size_t count=0;
+			current_guard guard(this);
+			mYield=false;
+			do {
+				step(vm,code,calcs);
+				++count;
+				if(++mPosit-1>=size) {
+					mStatus=thread_status::finish;
+					release_temps();
+					break;
+				}
+			}
+			while(count<quantum&&!mYield&&mStatus==thread_status::busy);
+			++mStats.slices;
+			mStats.instructions+=count;
+			return count;
+		}
+	};
+	class instruction_tag final:public instruction_base {
+	public:
+		virtual instruction_type type() const override
+		{
+			return instruction_type::tag;
+		}
+		virtual void exec(virtual_machine*,thread*) const override {}
+		virtual bool lower(instruction_record& rec,calc_table&) const override
+		{
+			rec.op=opcode::tag;
+			return true;
+		}
+	};
+	template<instruction_type _type>
+	class instruction_branch final:public instruction_base {
+		std::size_t mTarget;
+	public:
+		instruction_branch(std::size_t target):mTarget(target) {}
+		virtual instruction_type type() const override
+		{
+			return _type;
+		}
+		virtual void exec(virtual_machine*,thread* th) const override
+		{
+			switch(_type) {
+			case instruction_type::jict:
+				if(th->get_condition())
+					th->jump(mTarget);
+				break;
+			case instruction_type::jicf:
+				if(!th->get_condition())
+					th->jump(mTarget);
+				break;
+			default:
+				th->jump(mTarget);
+				break;
+			}
+		}
+		virtual bool lower(instruction_record& rec,calc_table&) const override
+		{
+			rec.op=_type==instruction_type::jict?opcode::jict:(_type==instruction_type::jicf?opcode::jicf:opcode::jump);
+			rec.operand=std::min<std::size_t>(mTarget,std::numeric_limits<std::uint32_t>::max());
+			return true;
+		}
+	};
+	using instruction_jump=instruction_branch<instruction_type::jump>;
+	using instruction_jict=instruction_branch<instruction_type::jict>;
+	using instruction_jicf=instruction_branch<instruction_type::jicf>;
+	class instruction_calc final:public instruction_base {
+		calc_function mFunc;
+		std::uint32_t mDst,mLhs,mRhs;
+	public:
+		instruction_calc(calc_function func,std::uint32_t dst,std::uint32_t lhs,std::uint32_t rhs):mFunc(func),mDst(dst),mLhs(lhs),mRhs(rhs)
+		{
+			if(func==nullptr)
+				throw lang_error("CSLE0008");
+		}
+		virtual instruction_type type() const override
+		{
+			return instruction_type::calc;
+		}
+		virtual void exec(virtual_machine*,thread* th) const override
+		{
+			th->set_condition(mFunc(th->get_register(mDst),th->get_register(mLhs),th->get_register(mRhs)));
+		}
+		virtual bool lower(instruction_record& rec,calc_table& calcs) const override
+		{
+			rec.op=opcode::calc;
+			rec.func=calcs.add(mFunc);
+			rec.dst=mDst;
+			rec.lhs=mLhs;
+			rec.rhs=mRhs;
+			return true;
 		}
 	};
 	class virtual_machine final {
-		using var_pointer_t=cov::storage<var,var_pool_size>::pointer;
+		using var_pointer_t=var_pointer;
 		using thread_pointer_t=std::shared_ptr<thread>;
-		cov::storage<var,var_pool_size> var_pool;
-		std::list<var_pointer_t> var_free_list;
+		class worker_queue final {
+			std::mutex mLock;
+			std::deque<thread_pointer_t> mQueue;
+		public:
+			void push(thread_pointer_t&& th)
+			{
+				std::lock_guard<std::mutex> guard(mLock);
+				mQueue.push_back(std::move(th));
+			}
+			bool empty()
+			{
+				std::lock_guard<std::mutex> guard(mLock);
+				return mQueue.empty();
+			}
+			bool pop(thread_pointer_t& th)
+			{
+				std::lock_guard<std::mutex> guard(mLock);
+				if(mQueue.empty())
+					return false;
+				th=std::move(mQueue.front());
+				mQueue.pop_front();
+				return true;
+			}
+			bool steal(thread_pointer_t& th)
+			{
+				std::lock_guard<std::mutex> guard(mLock);
+				if(mQueue.empty())
+					return false;
+				th=std::move(mQueue.back());
+				mQueue.pop_back();
+				return true;
+			}
+		};
+		// Thread handles may outlive the machine, their deleters reach it through this link and find it cleared once it is gone
+		struct machine_link final {
+			std::mutex lock;
+			virtual_machine* vm;
+			explicit machine_link(virtual_machine* ptr):vm(ptr) {}
+		};
+		std::shared_ptr<machine_link> link;
+		var_storage var_pool;
 		std::list<thread_pointer_t> thread_list;
+		std::mutex var_lock;
+		std::size_t worker_count=1;
+		std::size_t quantum=1;
+		bool latency_trace=false;
+		bool fusion=false;
+		std::vector<std::unique_ptr<worker_queue>> worker_queues;
+		std::atomic<std::size_t> alive_count {0};
+		std::atomic<std::size_t> join_count {0};
+		std::atomic<bool> parallel {false};
+		std::list<thread_pointer_t> park_list;
+		std::list<thread_pointer_t> wake_list;
+		std::mutex park_lock;
+		std::condition_variable park_cond;
+		// Threads waiting in a worker queue, not those a worker is running, and workers asleep until one is queued
+		std::atomic<std::size_t> queued_count {0};
+		std::atomic<std::size_t> idle_workers {0};
+		std::atomic<bool> wake_pending {false};
+#ifdef CS_PROFILE
+		std::mutex profile_lock;
+		// Codes are numbered in the order their first thread is created and held weakly, so profiling keeps no code alive
+		std::size_t profile_next_id=0;
+		std::size_t profile_prune_size=64;
+		std::unordered_map<const code_object*,std::pair<std::size_t,std::weak_ptr<const code_object>>> profile_codes;
+		void profile_code(const code_pointer& code)
+		{
+			std::lock_guard<std::mutex> guard(profile_lock);
+			auto& entry=profile_codes[code.get()];
+			// A new code may reuse the address of a freed one
+			if(entry.second.lock()!=code)
+				entry=std::make_pair(profile_next_id++,std::weak_ptr<const code_object>(code));
+			// Entries of freed codes still pin their control blocks, drop them once they could make up half the map
+			if(profile_codes.size()>=profile_prune_size) {
+				profile_live_codes();
+				profile_prune_size=std::max<std::size_t>(64,2*profile_codes.size());
+			}
+		}
+		// Drops the entries of freed codes, returns the others ordered by id
+		std::vector<std::pair<std::size_t,code_pointer>> profile_live_codes()
+		{
+			std::vector<std::pair<std::size_t,code_pointer>> codes;
+			for(auto it=profile_codes.begin(); it!=profile_codes.end();) {
+				code_pointer code=it->second.second.lock();
+				if(code==nullptr)
+					it=profile_codes.erase(it);
+				else {
+					codes.emplace_back(it->second.first,std::move(code));
+					++it;
+				}
+			}
+			std::sort(codes.begin(),codes.end(),[](const std::pair<std::size_t,code_pointer>& a,const std::pair<std::size_t,code_pointer>& b) {
+				return a.first<b.first;
+			});
+			return codes;
+		}
+		std::vector<profile_thread> profile_threads;
+		void profile_finish(const thread& th)
+		{
+			std::lock_guard<std::mutex> guard(profile_lock);
+			profile_thread rec;
+			rec.id=profile_threads.size();
+			rec.slices=th.get_stats().slices;
+			rec.instructions=th.get_stats().instructions;
+			rec.total_latency=th.get_stats().total_latency;
+			rec.max_latency=th.get_stats().max_latency;
+			profile_threads.push_back(rec);
+		}
+#endif
+		// Incremental mark and sweep over var_pool, stepped by the serial scheduler between slices
+		bool gc_enabled=false;
+		gc_phase gc_state=gc_phase::idle;
+		cov::timer::timer_t gc_budget=100000;
+		// The first cycle starts once a segment's worth of vars is live
+		std::size_t gc_min_threshold=var_segment_size;
+		std::size_t gc_threshold=var_segment_size;
+		std::size_t gc_cursor=0;
+		std::vector<var_pointer_t> gc_gray;
+		std::unordered_map<std::uint64_t,std::pair<var_pointer_t,std::size_t>> gc_roots;
+		gc_report gc_stats;
+		void gc_begin()
+		{
+			var_pool.next_epoch();
+			gc_gray.clear();
+			var_tracer tracer(var_pool,gc_gray);
+			for(auto& it:gc_roots)
+				tracer.mark(it.second.first);
+			gc_stats.marked+=tracer.mMarked;
+			gc_state=gc_phase::mark;
+			++gc_stats.cycles;
+		}
+		void gc_trace(var_tracer& tracer)
+		{
+			var_pointer_t vptr=gc_gray.back();
+			gc_gray.pop_back();
+			if(var_pool.usable(vptr))
+				var_pool.get_unchecked(vptr).trace(tracer);
+		}
+		// Registers are written without a barrier, so marking only ends once retracing every root finds nothing new.
+		// Roots pinned since the cycle began are marked here, nothing else reaches a var pinned while only the host held it.
+		// This rescan is not split across steps, the mutator must not run between it and the check.
+		bool gc_rescan(var_tracer& tracer)
+		{
+			std::size_t marked=tracer.mMarked;
+			for(auto& it:gc_roots) {
+				tracer.mark(it.second.first);
+				if(var_pool.usable(it.second.first))
+					var_pool.get_unchecked(it.second.first).trace(tracer);
+			}
+			while(!gc_gray.empty())
+				gc_trace(tracer);
+			return tracer.mMarked==marked;
+		}
+		// Returns true when the cycle has finished
+		bool gc_step(cov::timer::timer_t budget)
+		{
+			cov::timer::timer_t begin=cov::timer::time(cov::timer::time_unit::nano_sec);
+			var_tracer tracer(var_pool,gc_gray);
+			std::size_t freed=0;
+			for(std::size_t work=1; gc_state!=gc_phase::idle; ++work) {
+				if(gc_state==gc_phase::mark) {
+					if(!gc_gray.empty())
+						gc_trace(tracer);
+					else if(gc_rescan(tracer)) {
+						gc_state=gc_phase::sweep;
+						gc_cursor=0;
+					}
+				}
+				else {
+					gc_cursor=var_pool.sweep(gc_cursor,64,freed);
+					if(gc_cursor>=var_pool.extent()) {
+						gc_state=gc_phase::idle;
+						// Segments the cycle emptied go back once the pool is less than half full, so a pool
+						// hovering around a segment boundary does not free and rebuild one every cycle
+						if(2*var_pool.size()<var_pool.capacity())
+							var_pool.shrink();
+						gc_threshold=std::max(gc_min_threshold,2*var_pool.size());
+					}
+				}
+				if(work%64==0&&cov::timer::time(cov::timer::time_unit::nano_sec)-begin>=budget)
+					break;
+			}
+			gc_stats.marked+=tracer.mMarked;
+			gc_stats.freed+=freed;
+			gc_stats.record(cov::timer::time(cov::timer::time_unit::nano_sec)-begin);
+			return gc_state==gc_phase::idle;
+		}
+		void gc_poll()
+		{
+			if(gc_state==gc_phase::idle) {
+				if(var_pool.size()<gc_threshold)
+					return;
+				gc_begin();
+			}
+			gc_step(gc_budget);
+		}
+		std::exception_ptr worker_error;
+		std::mutex error_lock;
+		void run_slice(thread& th)
+		{
+			if(latency_trace) {
+				th.begin_slice(cov::timer::time(cov::timer::time_unit::nano_sec));
+				th.exec(this,quantum);
+				th.end_slice(cov::timer::time(cov::timer::time_unit::nano_sec));
+			}
+			else
+				th.exec(this,quantum);
+		}
+		bool park_thread(const thread_pointer_t& th)
+		{
+			std::lock_guard<std::mutex> guard(park_lock);
+			if(th->get_status()!=thread_status::idle)
+				return false;
+			th->mParked=true;
+			th->mParkPosit=park_list.insert(park_list.end(),th);
+			return true;
+		}
+		void leave_thread()
+		{
+			if(--alive_count==0) {
+				std::lock_guard<std::mutex> guard(park_lock);
+				park_cond.notify_all();
+			}
+		}
+		bool steal_thread(std::size_t id,thread_pointer_t& th)
+		{
+			for(std::size_t i=1; i<worker_queues.size(); ++i) {
+				if(worker_queues[(id+i)%worker_queues.size()]->steal(th))
+					return true;
+			}
+			return false;
+		}
+		// Counted before the push, a worker that sees the count finds the thread or retries shortly
+		void enqueue(std::size_t id,thread_pointer_t&& th)
+		{
+			++queued_count;
+			worker_queues[id]->push(std::move(th));
+		}
+		bool dequeue(std::size_t id,thread_pointer_t& th)
+		{
+			if(!worker_queues[id]->pop(th)&&!steal_thread(id,th))
+				return false;
+			--queued_count;
+			return true;
+		}
+		// A sleeper registers in idle_workers before it checks queued_count and an enqueue bumps queued_count
+		// before it reads idle_workers, so one of the two always sees the other
+		void wake_worker()
+		{
+			if(idle_workers.load()!=0) {
+				std::lock_guard<std::mutex> guard(park_lock);
+				park_cond.notify_one();
+			}
+		}
+		void worker_main(std::size_t id)
+		{
+			thread_pointer_t th;
+			try {
+				while(alive_count.load()!=0) {
+					// A thread still runnable after its slice stays with the worker while nothing else waits in its queue
+					if(!th&&!dequeue(id,th)) {
+						std::unique_lock<std::mutex> guard(park_lock);
+						++idle_workers;
+						park_cond.wait(guard,[this] {
+							return queued_count.load()!=0||alive_count.load()==0;
+						});
+						--idle_workers;
+						continue;
+					}
+					if(th->get_status()==thread_status::busy)
+						run_slice(*th);
+					thread_status status=th->get_status();
+					if(status==thread_status::finish) {
+#ifdef CS_PROFILE
+						profile_finish(*th);
+#endif
+						th.reset();
+						leave_thread();
+					}
+					else if(status==thread_status::idle&&park_thread(th))
+						th.reset();
+					else if(!worker_queues[id]->empty()) {
+						enqueue(id,std::move(th));
+						wake_worker();
+					}
+				}
+			}
+			catch(...) {
+				{
+					std::lock_guard<std::mutex> guard(error_lock);
+					if(!worker_error)
+						worker_error=std::current_exception();
+				}
+				// Under park_lock, or a worker between its check and its wait misses the wakeup
+				std::lock_guard<std::mutex> guard(park_lock);
+				alive_count=0;
+				park_cond.notify_all();
+			}
+		}
+		void start_parallel()
+		{
+			worker_queues.clear();
+			for(std::size_t i=0; i<worker_count; ++i)
+				worker_queues.emplace_back(new worker_queue);
+			alive_count=0;
+			queued_count=0;
+			idle_workers=0;
+			std::size_t posit=0;
+			for(auto& th:thread_list) {
+				if(th->get_status()!=thread_status::finish) {
+					++alive_count;
+					enqueue(posit++%worker_count,std::move(th));
+				}
+			}
+			thread_list.clear();
+			worker_error=nullptr;
+			parallel=true;
+			std::vector<std::thread> workers;
+			for(std::size_t i=1; i<worker_count; ++i)
+				workers.emplace_back(&virtual_machine::worker_main,this,i);
+			worker_main(0);
+			for(auto& worker:workers)
+				worker.join();
+			parallel=false;
+			worker_queues.clear();
+			queued_count=0;
+			if(worker_error)
+				std::rethrow_exception(worker_error);
+		}
 	public:
-		virtual_machine()=default;
+		virtual_machine():link(std::make_shared<machine_link>(this)) {}
 		virtual_machine(const virtual_machine&)=delete;
-		~virtual_machine()=default;
-		thread_pointer_t create_thread(const std::deque<instruction_base*>& ins)
+		~virtual_machine()
 		{
-			return std::make_shared<thread>(ins);
+			std::lock_guard<std::mutex> guard(link->lock);
+			link->vm=nullptr;
+		}
+		code_pointer create_code(const std::deque<instruction_base*>& ins)
+		{
+			return std::make_shared<const code_object>(ins,fusion);
+		}
+		thread_pointer_t create_thread(const code_pointer& code,std::size_t regs=0)
+		{
+#ifdef CS_PROFILE
+			profile_code(code);
+#endif
+			regs=std::max(regs,code->register_count());
+			if(regs==0)
+				return std::make_shared<thread>(code);
+			std::shared_ptr<machine_link> owner=link;
+			thread_pointer_t th(new thread(code),[owner](thread* ptr) {
+				{
+					// The registers went down with the var pool of a destroyed machine
+					std::lock_guard<std::mutex> guard(owner->lock);
+					if(owner->vm!=nullptr) {
+						for(auto& slot:ptr->mRegs) {
+							owner->vm->unpin_var(slot.handle);
+							owner->vm->free_var(slot.handle);
+						}
+					}
+				}
+				delete ptr;
+			});
+			th->mRegs.reserve(regs);
+			for(std::size_t i=0; i<regs; ++i) {
+				var_pointer vptr=create_var();
+				pin_var(vptr);
+				th->mRegs.push_back({vptr,&var_pool.get_unchecked(vptr)});
+			}
+			return th;
+		}
+		thread_pointer_t create_thread(const std::deque<instruction_base*>& ins,std::size_t regs=0)
+		{
+			return create_thread(create_code(ins),regs);
 		}
 		void join_thread(thread_pointer_t th)
 		{
 			if(th->get_status()!=thread_status::ready)
 				throw lang_error("CSLE0003");
 			th->set_status(thread_status::busy);
-			thread_list.push_back(th);
+			if(parallel) {
+				std::lock_guard<std::mutex> guard(park_lock);
+				++alive_count;
+				enqueue(join_count++%worker_queues.size(),std::move(th));
+				park_cond.notify_one();
+			}
+			else
+				thread_list.push_back(th);
+		}
+		void notify(thread* th)
+		{
+			std::lock_guard<std::mutex> guard(park_lock);
+			if(th->get_status()!=thread_status::idle)
+				return;
+			th->set_status(thread_status::busy);
+			if(!th->mParked)
+				return;
+			th->mParked=false;
+			if(parallel) {
+				// Off the park list before it is queued, a worker may run and free the thread as soon as it is pushed
+				auto posit=th->mParkPosit;
+				thread_pointer_t handle=std::move(*posit);
+				park_list.erase(posit);
+				enqueue(join_count++%worker_queues.size(),std::move(handle));
+			}
+			else {
+				wake_list.splice(wake_list.end(),park_list,th->mParkPosit);
+				wake_pending=true;
+			}
+			park_cond.notify_one();
+		}
+#ifdef CS_PROFILE
+		profile_report profile()
+		{
+			std::lock_guard<std::mutex> guard(profile_lock);
+			profile_report report;
+			report.types.resize(static_cast<std::size_t>(opcode::calc_jicf)+1);
+			for(std::size_t i=0; i<report.types.size(); ++i)
+				report.types[i].name=opcode_name(static_cast<opcode>(i));
+			for(auto& it:profile_live_codes()) {
+				const code_object& code=*it.second;
+				for(std::size_t i=0; i<code.size(); ++i) {
+					profile_record rec;
+					rec.name="code"+std::to_string(it.first)+":"+std::to_string(i)+":"+opcode_name(code.records()[i].op);
+					rec.count=code.profile(i).count;
+					rec.time=code.profile(i).time;
+					profile_record& type=report.types[static_cast<std::size_t>(code.records()[i].op)];
+					type.count+=rec.count;
+					type.time+=rec.time;
+					report.instructions.push_back(rec);
+				}
+			}
+			report.threads=profile_threads;
+			return report;
+		}
+		void reset_profile()
+		{
+			std::lock_guard<std::mutex> guard(profile_lock);
+			for(auto& it:profile_live_codes())
+				for(std::size_t i=0; i<it.second->size(); ++i)
+					it.second->profile(i).reset();
+			profile_threads.clear();
+		}
+#endif
+		// Cheap enough to poll
+		memory_report memory()
+		{
+			memory_report report;
+			{
+				std::unique_lock<std::mutex> guard(var_lock,std::defer_lock);
+				if(parallel)
+					guard.lock();
+				report.var_pool=var_pool.stats();
+			}
+			report.slabs=cov::slab_registry::stats();
+			report.holders=holder_registry::stats();
+			report.allocators=cov::allocator_registry::stats();
+			report.shared_control_blocks=cov::shared_control_blocks();
+			report.huge_pages=cov::huge_page_region::get().stats();
+			return report;
+		}
+		void reset_memory_peak()
+		{
+			std::unique_lock<std::mutex> guard(var_lock,std::defer_lock);
+			if(parallel)
+				guard.lock();
+			var_pool.reset_peak();
+		}
+		std::size_t parked_threads()
+		{
+			std::lock_guard<std::mutex> guard(park_lock);
+			return park_list.size();
+		}
+		std::size_t sleeping_workers() const
+		{
+			return idle_workers.load();
+		}
+		void set_worker_count(std::size_t count)
+		{
+			if(parallel)
+				throw lang_error("CSLE0004");
+			worker_count=count!=0?count:std::max<std::size_t>(std::thread::hardware_concurrency(),1);
+		}
+		std::size_t get_worker_count() const noexcept
+		{
+			return worker_count;
+		}
+		void set_quantum(std::size_t count) noexcept
+		{
+			quantum=count!=0?count:std::numeric_limits<std::size_t>::max();
+		}
+		std::size_t get_quantum() const noexcept
+		{
+			return quantum;
+		}
+		void enable_fusion() noexcept
+		{
+			fusion=true;
+		}
+		void disable_fusion() noexcept
+		{
+			fusion=false;
+		}
+		void enable_latency_trace() noexcept
+		{
+			latency_trace=true;
+		}
+		void disable_latency_trace() noexcept
+		{
+			latency_trace=false;
 		}
 		var_pointer_t create_var()
 		{
-			if(!var_free_list.empty()) {
-				var_pointer_t vptr=var_free_list.back();
-				var_free_list.pop_back();
-				return vptr;
+			std::unique_lock<std::mutex> guard(var_lock,std::defer_lock);
+			if(parallel)
+				guard.lock();
+			return var_pool.alloc();
+		}
+		void free_var(var_pointer_t vptr)
+		{
+			std::unique_lock<std::mutex> guard(var_lock,std::defer_lock);
+			if(parallel)
+				guard.lock();
+			var_pool.free(vptr);
+		}
+		// While a collection is marking, a var changed through a reference from here is traced again.
+		// Hosts have to fetch the reference anew after the scheduler has run instead of keeping it.
+		var& get_var(var_pointer_t vptr)
+		{
+			std::unique_lock<std::mutex> guard(var_lock,std::defer_lock);
+			if(parallel)
+				guard.lock();
+			var& val=var_pool.get(vptr);
+			if(gc_state==gc_phase::mark&&(gc_gray.empty()||gc_gray.back()!=vptr))
+				gc_gray.push_back(vptr);
+			return val;
+		}
+		// As get_var() for handles known to be current, such as ones checked with usable_var() outside a hot loop
+		var& get_var_unchecked(var_pointer_t vptr)
+		{
+			if(gc_state==gc_phase::mark) {
+				std::unique_lock<std::mutex> guard(var_lock,std::defer_lock);
+				if(parallel)
+					guard.lock();
+				if(gc_gray.empty()||gc_gray.back()!=vptr)
+					gc_gray.push_back(vptr);
 			}
+			return var_pool.get_unchecked(vptr);
+		}
+		// False once the var was freed, even if its slot has been reused since
+		bool usable_var(var_pointer_t vptr)
+		{
+			std::unique_lock<std::mutex> guard(var_lock,std::defer_lock);
+			if(parallel)
+				guard.lock();
+			return var_pool.usable(vptr);
+		}
+		// Pinned vars are roots of the collector, pins nest
+		void pin_var(var_pointer_t vptr)
+		{
+			std::unique_lock<std::mutex> guard(var_lock,std::defer_lock);
+			if(parallel)
+				guard.lock();
+			auto it=gc_roots.find(vptr.id());
+			if(it==gc_roots.end())
+				gc_roots.emplace(vptr.id(),std::make_pair(vptr,std::size_t(1)));
 			else
-				return var_pool.alloc();
+				++it->second.second;
 		}
-		void free_var(var_pointer_t vptr)
+		void unpin_var(var_pointer_t vptr)
+		{
+			std::unique_lock<std::mutex> guard(var_lock,std::defer_lock);
+			if(parallel)
+				guard.lock();
+			auto it=gc_roots.find(vptr.id());
+			if(it!=gc_roots.end()&&--it->second.second==0)
+				gc_roots.erase(it);
+		}
+		// The collector only runs from the serial scheduler, start() with several workers leaves it paused
+		void enable_gc() noexcept
+		{
+			gc_enabled=true;
+		}
+		void disable_gc() noexcept
 		{
-			var_free_list.push_front(vptr);
+			gc_enabled=false;
+		}
+		void set_gc_budget(cov::timer::timer_t ns) noexcept
+		{
+			gc_budget=ns!=0?ns:std::numeric_limits<cov::timer::timer_t>::max();
+		}
+		cov::timer::timer_t get_gc_budget() const noexcept
+		{
+			return gc_budget;
+		}
+		// A cycle starts once this many vars are live, then at twice the survivors of the last cycle
+		void set_gc_threshold(std::size_t count) noexcept
+		{
+			gc_min_threshold=std::max<std::size_t>(count,1);
+			gc_threshold=gc_min_threshold;
+		}
+		gc_phase get_gc_phase() const noexcept
+		{
+			return gc_state;
+		}
+		// Finish the running cycle, then run a whole new one without a pause budget
+		void collect()
+		{
+			if(parallel)
+				throw lang_error("CSLE0016");
+			if(gc_state!=gc_phase::idle)
+				while(!gc_step(std::numeric_limits<cov::timer::timer_t>::max()));
+			gc_begin();
+			while(!gc_step(std::numeric_limits<cov::timer::timer_t>::max()));
+		}
+		const gc_report& gc_profile() const noexcept
+		{
+			return gc_stats;
+		}
+		void reset_gc_profile()
+		{
+			gc_stats=gc_report();
 		}
 		void start()
 		{
-			while(!thread_list.empty()) {
-				thread_list.remove_if([](const thread_pointer_t& th) {
-					return th->get_status()==thread_status::finish;
-				});
-				for(auto& th:thread_list) {
-					if(th->get_status()!=thread_status::idle&&th->get_status()!=thread_status::finish)
-						th->exec(this);
+			if(worker_count>1)
+				return start_parallel();
+			while(true) {
+				if(wake_pending.load()) {
+					std::lock_guard<std::mutex> guard(park_lock);
+					thread_list.splice(thread_list.end(),wake_list);
+					wake_pending=false;
 				}
+				if(thread_list.empty()) {
+					std::unique_lock<std::mutex> guard(park_lock);
+					park_cond.wait(guard,[this] {
+						return !wake_list.empty()||park_list.empty();
+					});
+					if(wake_list.empty())
+						break;
+					thread_list.splice(thread_list.end(),wake_list);
+					wake_pending=false;
+				}
+				for(auto it=thread_list.begin(); it!=thread_list.end();) {
+					thread_status status=(*it)->get_status();
+					if(status!=thread_status::idle&&status!=thread_status::finish) {
+						run_slice(**it);
+						status=(*it)->get_status();
+						if(gc_enabled)
+							gc_poll();
+					}
+#ifdef CS_PROFILE
+					if(status==thread_status::finish)
+						profile_finish(**it);
+#endif
+					if(status==thread_status::finish||(status==thread_status::idle&&park_thread(*it)))
+						it=thread_list.erase(it);
+					else
+						++it;
+				}
+			}
+		}
+	};
+	class wait_queue final {
+		std::mutex mLock;
+		std::deque<thread*> mWaiters;
+	public:
+		wait_queue()=default;
+		wait_queue(const wait_queue&)=delete;
+		~wait_queue()=default;
+		void wait(thread* th)
+		{
+			std::lock_guard<std::mutex> guard(mLock);
+			th->set_status(thread_status::idle);
+			mWaiters.push_back(th);
+		}
+		bool notify_one(virtual_machine* vm)
+		{
+			thread* th=nullptr;
+			{
+				std::lock_guard<std::mutex> guard(mLock);
+				if(mWaiters.empty())
+					return false;
+				th=mWaiters.front();
+				mWaiters.pop_front();
+			}
+			vm->notify(th);
+			return true;
+		}
+		std::size_t notify_all(virtual_machine* vm)
+		{
+			std::deque<thread*> waiters;
+			{
+				std::lock_guard<std::mutex> guard(mLock);
+				waiters.swap(mWaiters);
 			}
+			for(auto th:waiters)
+				vm->notify(th);
+			return waiters.size();
 		}
 	};
 }
@@ -25,7 +25,20 @@
 #include "./function.hpp"
 #include <memory>
 #include <atomic>
+#include <mutex>
 #include <array>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <algorithm>
+#include <unordered_map>
+#include <string>
+#include <typeinfo>
+#if defined(__linux__)
+#include <sys/mman.h>
+#define COV_HUGE_PAGES_MMAP
+#endif
 
 namespace cov {
 	template<typename _Tp,template<typename>class _alloc>
@@ -34,129 +47,461 @@ namespace cov {
 	};
 	template<typename _Tp,template<typename>class _alloc>
 	_alloc<_Tp> _alloc_helper<_Tp,_alloc>::allocator;
+	// Counter split into per-thread slots. A thread leases one slot for its lifetime and is its only
+	// writer, so counting needs no locked instruction. Threads beyond the slot count share an atomic one.
+	class striped_counter final {
+		static constexpr std::size_t slot_count=32;
+		static constexpr std::size_t unleased=std::size_t(-1);
+		static constexpr std::size_t shared=std::size_t(-2);
+		struct alignas(64) slot {
+			std::atomic<long> value {0};
+		};
+		struct lease_table {
+			std::mutex lock;
+			std::vector<std::size_t> free;
+			std::size_t next=0;
+		};
+		slot mSlots[slot_count];
+		slot mShared;
+		static lease_table& leases()
+		{
+			static lease_table* t=new lease_table;
+			return *t;
+		}
+		static std::size_t& lease() noexcept
+		{
+			static thread_local std::size_t id=unleased;
+			return id;
+		}
+		static std::size_t acquire()
+		{
+			struct sentinel {
+				~sentinel()
+				{
+					lease_table& t=leases();
+					std::lock_guard<std::mutex> guard(t.lock);
+					t.free.push_back(lease());
+					lease()=shared;
+				}
+			};
+			lease_table& t=leases();
+			{
+				std::lock_guard<std::mutex> guard(t.lock);
+				if(!t.free.empty()) {
+					lease()=t.free.back();
+					t.free.pop_back();
+				}
+				else if(t.next<slot_count)
+					lease()=t.next++;
+				else
+					return lease()=shared;
+			}
+			static thread_local sentinel s;
+			(void)s;
+			return lease();
+		}
+	public:
+		constexpr striped_counter()=default;
+		striped_counter(const striped_counter&)=delete;
+		void add(long n) noexcept
+		{
+			std::size_t id=lease();
+			if(id==unleased)
+				id=acquire();
+			if(id<slot_count) {
+				std::atomic<long>& value=mSlots[id].value;
+				value.store(value.load(std::memory_order_relaxed)+n,std::memory_order_relaxed);
+			}
+			else
+				mShared.value.fetch_add(n,std::memory_order_relaxed);
+		}
+		long get() const noexcept
+		{
+			long sum=mShared.value.load(std::memory_order_relaxed);
+			for(auto& s:mSlots)
+				sum+=s.value.load(std::memory_order_relaxed);
+			return sum;
+		}
+	};
+	// Control blocks of every non-intrusive shared_ptr alive in the process
+	inline striped_counter& shared_control_counter()
+	{
+		static striped_counter counter;
+		return counter;
+	}
+	inline std::size_t shared_control_blocks()
+	{
+		return shared_control_counter().get();
+	}
+	// Counting policy for shared_ptr owned by a single thread
+	template<typename _Tp>
+	class nonatomic final {
+		_Tp mVal;
+	public:
+		nonatomic(_Tp val=_Tp()):mVal(val) {}
+		nonatomic(const nonatomic&)=delete;
+		nonatomic& operator=(_Tp val)
+		{
+			mVal=val;
+			return *this;
+		}
+		_Tp operator++()
+		{
+			return ++mVal;
+		}
+		_Tp operator--()
+		{
+			return --mVal;
+		}
+		operator _Tp() const
+		{
+			return mVal;
+		}
+	};
+	template<typename _Tp,template<typename>class _alloc,template<typename>class _atomic,bool _intrusive>
+	struct _shared_control;
+	// Types deriving from ref_counted carry their own count, shared_ptr to them needs no control block
+	template<template<typename>class _atomic=std::atomic>
+	class ref_counted {
+		template<typename,template<typename>class,template<typename>class,bool>
+		friend struct _shared_control;
+		mutable _atomic<unsigned long> mRefCount {0};
+	public:
+		ref_counted()=default;
+		ref_counted(const ref_counted&) {}
+		ref_counted& operator=(const ref_counted&)
+		{
+			return *this;
+		}
+		unsigned long use_count() const
+		{
+			return mRefCount;
+		}
+	};
+	template<typename _Tp> class is_ref_counted {
+		template<template<typename>class _atomic> static constexpr bool match(const ref_counted<_atomic>*)
+		{
+			return true;
+		}
+		static constexpr bool match(...)
+		{
+			return false;
+		}
+	public:
+		static constexpr bool value=match(static_cast<const _Tp*>(nullptr));
+	};
+	template<typename _Tp,template<typename>class _alloc,template<typename>class _atomic>
+	struct _shared_control<_Tp,_alloc,_atomic,false> {
+		typedef cov::function<void(_Tp*)> deleter;
+		// The object lives inside its control block, so one allocation serves both
+		struct proxy {
+			mutable _atomic<unsigned long> ref_count;
+			void(*release)(proxy*);
+			_Tp data;
+			template<typename...ArgsT>
+			proxy(void(*func)(proxy*),ArgsT&&...args):ref_count(1),release(func),data(std::forward<ArgsT>(args)...) {}
+		};
+		// Only control blocks with a custom deleter pay for storing it
+		struct deleter_proxy:public proxy {
+			deleter resolve;
+			template<typename...ArgsT>
+			deleter_proxy(const deleter& f,ArgsT&&...args):proxy(&release_with,std::forward<ArgsT>(args)...),resolve(f) {}
+		};
+		typedef proxy* handle;
+		template<typename T,typename...ArgsT>
+		static T* construct(ArgsT&&...args)
+		{
+			T* ptr=_alloc_helper<T,_alloc>::allocator.allocate(1);
+			try {
+				_alloc_helper<T,_alloc>::allocator.construct(ptr,std::forward<ArgsT>(args)...);
+			}
+			catch(...) {
+				_alloc_helper<T,_alloc>::allocator.deallocate(ptr,1);
+				throw;
+			}
+			shared_control_counter().add(1);
+			return ptr;
+		}
+		template<typename T>
+		static void destroy(T* ptr)
+		{
+			_alloc_helper<T,_alloc>::allocator.destroy(ptr);
+			_alloc_helper<T,_alloc>::allocator.deallocate(ptr,1);
+			shared_control_counter().add(-1);
+		}
+		static void release(proxy* p)
+		{
+			destroy(p);
+		}
+		static void release_with(proxy* p)
+		{
+			deleter_proxy* dp=static_cast<deleter_proxy*>(p);
+			if(dp->resolve.callable())
+				dp->resolve(&dp->data);
+			destroy(dp);
+		}
+		template<typename...ArgsT>
+		static handle create(ArgsT&&...args)
+		{
+			return construct<proxy>(&release,std::forward<ArgsT>(args)...);
+		}
+		template<typename...ArgsT>
+		static handle create_with(const deleter& f,ArgsT&&...args)
+		{
+			return construct<deleter_proxy>(f,std::forward<ArgsT>(args)...);
+		}
+		static _Tp* get(handle h)
+		{
+			return &h->data;
+		}
+		static unsigned long use_count(handle h)
+		{
+			return h->ref_count;
+		}
+		static void add_ref(handle h)
+		{
+			++h->ref_count;
+		}
+		static void cut_ref(handle h)
+		{
+			if(--h->ref_count==0)
+				h->release(h);
+		}
+	};
+	template<typename _Tp,template<typename>class _alloc,template<typename>class _atomic>
+	struct _shared_control<_Tp,_alloc,_atomic,true> {
+		typedef cov::function<void(_Tp*)> deleter;
+		typedef _Tp* handle;
+		template<typename...ArgsT>
+		static handle create(ArgsT&&...args)
+		{
+			_Tp* ptr=_alloc_helper<_Tp,_alloc>::allocator.allocate(1);
+			try {
+				_alloc_helper<_Tp,_alloc>::allocator.construct(ptr,std::forward<ArgsT>(args)...);
+			}
+			catch(...) {
+				_alloc_helper<_Tp,_alloc>::allocator.deallocate(ptr,1);
+				throw;
+			}
+			ptr->mRefCount=1;
+			return ptr;
+		}
+		template<typename...ArgsT>
+		static handle create_with(const deleter&,ArgsT&&...)
+		{
+			static_assert(sizeof(_Tp)==0,"E000S");
+			return nullptr;
+		}
+		static _Tp* get(handle h)
+		{
+			return h;
+		}
+		static unsigned long use_count(handle h)
+		{
+			return h->mRefCount;
+		}
+		static void add_ref(handle h)
+		{
+			++h->mRefCount;
+		}
+		static void cut_ref(handle h)
+		{
+			if(--h->mRefCount==0) {
+				_alloc_helper<_Tp,_alloc>::allocator.destroy(h);
+				_alloc_helper<_Tp,_alloc>::allocator.deallocate(h,1);
+			}
+		}
+	};
 	template<typename _Tp,
 	         template<typename>class _alloc=std::allocator,
 	         template<typename>class _atomic=std::atomic>
 	class shared_ptr final {
+		typedef _shared_control<_Tp,_alloc,_atomic,is_ref_counted<_Tp>::value> control;
 	public:
 		typedef _atomic<unsigned long> counter;
 		typedef _Tp data_type;
 		typedef _Tp* raw_type;
 		typedef cov::function<void(raw_type)> deleter;
 	private:
-		class proxy final {
-			friend class shared_ptr<_Tp,_alloc,_atomic>;
-			mutable counter ref_count;
-			deleter resolve;
-			raw_type data=nullptr;
-			void add_ref() const
-			{
-				++ref_count;
-			}
-			void cut_ref() const
-			{
-				if(--ref_count==0) {
-					if(resolve.callable())
-						resolve(data);
-					_alloc_helper<data_type,_alloc>::allocator.destroy(data);
-					_alloc_helper<data_type,_alloc>::allocator.deallocate(data,1);
-				}
-			}
-		};
-		proxy* mProxy;
+		typename control::handle mProxy=nullptr;
 	public:
-		shared_ptr():mProxy(_alloc_helper<proxy,_alloc>::allocator.allocate(1))
-		{
-			mProxy->ref_count=1;
-			mProxy->data=_alloc_helper<data_type,_alloc>::allocator.allocate(1);
-			_alloc_helper<data_type,_alloc>::allocator.construct(mProxy->data);
-		}
-		shared_ptr(const deleter& f):mProxy(_alloc_helper<proxy,_alloc>::allocator.allocate(1))
+		template<typename...ArgsT>
+		static shared_ptr make(ArgsT&&...args)
 		{
-			mProxy->ref_count=1;
-			mProxy->deleter=f;
-			mProxy->data=_alloc_helper<data_type,_alloc>::allocator.allocate(1);
-			_alloc_helper<data_type,_alloc>::allocator.construct(mProxy->data);
+			shared_ptr ptr(nullptr);
+			ptr.mProxy=control::create(std::forward<ArgsT>(args)...);
+			return ptr;
 		}
+		shared_ptr():mProxy(control::create()) {}
+		shared_ptr(std::nullptr_t) {}
+		shared_ptr(const deleter& f):mProxy(control::create_with(f)) {}
 		shared_ptr(const shared_ptr& ptr):mProxy(ptr.mProxy)
 		{
-			mProxy->add_ref();
-		}
-		shared_ptr(const data_type& obj):mProxy(_alloc_helper<proxy,_alloc>::allocator.allocate(1))
-		{
-			mProxy->ref_count=1;
-			mProxy->data=_alloc_helper<_Tp,_alloc>::allocator.allocate(1);
-			_alloc_helper<data_type,_alloc>::allocator.construct(mProxy->data,obj);
+			if(mProxy!=nullptr)
+				control::add_ref(mProxy);
 		}
-		shared_ptr(const data_type& obj,const deleter& f):mProxy(_alloc_helper<proxy,_alloc>::allocator.allocate(1))
+		shared_ptr(shared_ptr&& ptr) noexcept:mProxy(ptr.mProxy)
 		{
-			mProxy->ref_count=1;
-			mProxy->deleter=f;
-			mProxy->data=_alloc_helper<_Tp,_alloc>::allocator.allocate(1);
-			_alloc_helper<data_type,_alloc>::allocator.construct(mProxy->data,obj);
+			ptr.mProxy=nullptr;
 		}
+		shared_ptr(const data_type& obj):mProxy(control::create(obj)) {}
+		shared_ptr(const data_type& obj,const deleter& f):mProxy(control::create_with(f,obj)) {}
 		~shared_ptr()
 		{
-			mProxy->cut_ref();
-			if(mProxy->ref_count==0) {
-				_alloc_helper<proxy,_alloc>::allocator.destroy(mProxy);
-				_alloc_helper<proxy,_alloc>::allocator.deallocate(mProxy,1);
-			}
+			if(mProxy!=nullptr)
+				control::cut_ref(mProxy);
 		}
 		shared_ptr& operator=(const shared_ptr& ptr)
+		{
+			if(ptr.mProxy!=nullptr)
+				control::add_ref(ptr.mProxy);
+			if(mProxy!=nullptr)
+				control::cut_ref(mProxy);
+			mProxy=ptr.mProxy;
+			return *this;
+		}
+		shared_ptr& operator=(shared_ptr&& ptr) noexcept
 		{
 			if(&ptr!=this) {
-				mProxy->cut_ref();
-				if(mProxy->ref_count==0) {
-					_alloc_helper<proxy,_alloc>::allocator.destroy(mProxy);
-					_alloc_helper<proxy,_alloc>::allocator.deallocate(mProxy,1);
-				}
+				if(mProxy!=nullptr)
+					control::cut_ref(mProxy);
 				mProxy=ptr.mProxy;
-				++mProxy->ref_count;
+				ptr.mProxy=nullptr;
 			}
 			return *this;
 		}
+		explicit operator bool() const noexcept
+		{
+			return mProxy!=nullptr;
+		}
+		unsigned long use_count() const
+		{
+			return mProxy!=nullptr?control::use_count(mProxy):0;
+		}
 		data_type& operator*()
 		{
-			return *mProxy->data;
+			return *control::get(mProxy);
 		}
 		raw_type operator->()
 		{
-			return mProxy->data;
+			return control::get(mProxy);
 		}
 		const data_type& operator*() const
 		{
-			return *mProxy->data;
+			return *control::get(mProxy);
+		}
+		raw_type operator->() const
+		{
+			return control::get(mProxy);
+		}
+	};
+	struct allocator_stats final {
+		// Mangled name of the allocated type
+		std::string type;
+		std::size_t block_size=0;
+		long offset=-1;
+		// Allocations served from the cache, and those that went to the heap
+		std::size_t hits=0;
+		std::size_t misses=0;
+		double hit_rate() const
+		{
+			return hits+misses==0?0:double(hits)/(hits+misses);
+		}
+	};
+	// Live objects that report stats_t. Unlike stats_registry the sources come and go with their owners,
+	// and an owner that removes itself waits for a running stats() to finish.
+	template<typename stats_t>
+	class instance_registry final {
+		struct source {
+			const void* owner;
+			stats_t(*get)(const void*);
+		};
+		// Leaked, owners with static storage may remove themselves after other statics are gone
+		static std::mutex& lock()
+		{
+			static std::mutex* m=new std::mutex;
+			return *m;
+		}
+		static std::vector<source>& sources()
+		{
+			static std::vector<source>* p=new std::vector<source>;
+			return *p;
+		}
+	public:
+		static void add(const void* owner,stats_t(*get)(const void*))
+		{
+			std::lock_guard<std::mutex> guard(lock());
+			sources().push_back({owner,get});
+		}
+		static void remove(const void* owner)
+		{
+			std::lock_guard<std::mutex> guard(lock());
+			std::vector<source>& p=sources();
+			for(auto it=p.begin(); it!=p.end(); ++it) {
+				if(it->owner==owner) {
+					p.erase(it);
+					return;
+				}
+			}
 		}
-		const raw_type operator->() const
+		static std::vector<stats_t> stats()
 		{
-			return mProxy->data;
+			std::lock_guard<std::mutex> guard(lock());
+			std::vector<stats_t> result;
+			for(auto& s:sources())
+				result.push_back(s.get(s.owner));
+			return result;
 		}
 	};
+	using allocator_registry=instance_registry<allocator_stats>;
+	// Every allocator lists itself in allocator_registry. The counters have a single writer, the owning
+	// thread, and are atomic only so that a snapshot taken on another thread reads whole values.
 	template<typename T,long blck_size>
 	class allocator final {
 		std::allocator<T> mAlloc;
 		std::array<T*,blck_size> mPool;
-		long mOffset=-1;
+		std::atomic<long> mOffset {-1};
 		bool mActived=true;
+		std::atomic<std::size_t> mHits {0};
+		std::atomic<std::size_t> mMisses {0};
+		static void bump(std::atomic<std::size_t>& counter) noexcept
+		{
+			counter.store(counter.load(std::memory_order_relaxed)+1,std::memory_order_relaxed);
+		}
+		long offset() const noexcept
+		{
+			return mOffset.load(std::memory_order_relaxed);
+		}
+		void offset(long off) noexcept
+		{
+			mOffset.store(off,std::memory_order_relaxed);
+		}
+		static allocator_stats collect(const void* self)
+		{
+			return static_cast<const allocator*>(self)->stats();
+		}
 	public:
 		void blance()
 		{
-			if(mOffset!=0.5*blck_size) {
-				if(mOffset<0.5*blck_size) {
-					for(; mOffset<0.5*blck_size; ++mOffset)
-						mPool.at(mOffset+1)=mAlloc.allocate(1);
+			long off=offset();
+			if(off!=0.5*blck_size) {
+				if(off<0.5*blck_size) {
+					for(; off<0.5*blck_size; ++off)
+						mPool.at(off+1)=mAlloc.allocate(1);
 				}
 				else {
-					for(; mOffset>0.5*blck_size; --mOffset)
-						mAlloc.deallocate(mPool.at(mOffset),1);
+					for(; off>0.5*blck_size; --off)
+						mAlloc.deallocate(mPool.at(off),1);
 				}
 			}
+			offset(off);
 		}
 		void clean()
 		{
-			for(; mOffset>=0; --mOffset)
-				mAlloc.deallocate(mPool.at(mOffset),1);
+			long off=offset();
+			for(; off>=0; --off)
+				mAlloc.deallocate(mPool.at(off),1);
+			offset(off);
 		}
 		void enable_buffer()
 		{
@@ -171,103 +516,938 @@ namespace cov {
 		allocator()
 		{
 			blance();
+			allocator_registry::add(this,&collect);
 		}
 		allocator(const allocator&)=delete;
 		~allocator()
 		{
+			allocator_registry::remove(this);
 			clean();
 		}
 		template<typename...ArgsT>
 		T* alloc(ArgsT&&...args)
 		{
 			T* ptr=nullptr;
-			if(mActived&&mOffset>=0) {
-				ptr=mPool.at(mOffset);
-				--mOffset;
+			long off=offset();
+			if(mActived&&off>=0) {
+				ptr=mPool.at(off);
+				offset(off-1);
+				bump(mHits);
 			}
-			else
+			else {
 				ptr=mAlloc.allocate(1);
+				bump(mMisses);
+			}
 			mAlloc.construct(ptr,std::forward<ArgsT>(args)...);
 			return ptr;
 		}
 		void free(T* ptr)
 		{
 			mAlloc.destroy(ptr);
-			if(mActived&&mOffset<blck_size-1) {
-				++mOffset;
-				mPool.at(mOffset)=ptr;
+			long off=offset();
+			if(mActived&&off<blck_size-1) {
+				mPool.at(off+1)=ptr;
+				offset(off+1);
 			}
 			else
 				mAlloc.deallocate(ptr,1);
 		}
+		allocator_stats stats() const
+		{
+			allocator_stats s;
+			s.type=typeid(T).name();
+			s.block_size=blck_size;
+			s.offset=offset();
+			s.hits=mHits.load(std::memory_order_relaxed);
+			s.misses=mMisses.load(std::memory_order_relaxed);
+			return s;
+		}
 	};
-	template<typename T,std::size_t pool_size=10240,template<typename>class allocator_t=std::allocator,template<typename,std::size_t>class array_t=std::array>
+	// Size classes step by 16 bytes up to 256 and by powers of two beyond
+	constexpr std::size_t _pow2_ceil(std::size_t size,std::size_t pow=512)
+	{
+		return pow>=size?pow:_pow2_ceil(size,pow*2);
+	}
+	constexpr std::size_t slab_size_class(std::size_t size)
+	{
+		return size<=16?16:size<=256?(size+15)/16*16:_pow2_ceil(size);
+	}
+	struct slab_stats final {
+		std::size_t block_size=0;
+		std::size_t slab_count=0;
+		// Blocks in all slabs, and blocks never handed out yet
+		std::size_t capacity=0;
+		std::size_t untouched=0;
+		// Blocks returned to the shared free list or parked in the depot
+		std::size_t free=0;
+		// Blocks held by live objects or cached in per-thread magazines
+		std::size_t outstanding=0;
+		double occupancy() const
+		{
+			return capacity==0?0:double(outstanding)/capacity;
+		}
+		// Share of the touched blocks that sit free instead of holding objects
+		double fragmentation() const
+		{
+			return capacity==untouched?0:double(free)/(capacity-untouched);
+		}
+	};
+	// Sources of statistics register themselves once and are polled on every snapshot
+	template<typename stats_t>
+	class stats_registry final {
+		static std::mutex& lock()
+		{
+			static std::mutex m;
+			return m;
+		}
+		static std::vector<stats_t(*)()>& sources()
+		{
+			static std::vector<stats_t(*)()> p;
+			return p;
+		}
+	public:
+		static void add(stats_t(*func)())
+		{
+			std::lock_guard<std::mutex> guard(lock());
+			sources().push_back(func);
+		}
+		static std::vector<stats_t> stats()
+		{
+			std::lock_guard<std::mutex> guard(lock());
+			std::vector<stats_t> result;
+			for(auto func:sources())
+				result.push_back(func());
+			return result;
+		}
+	};
+	using slab_registry=stats_registry<slab_stats>;
+	struct huge_page_stats final {
+		// Address space mapped for the regions, and the part of it handed out so far
+		std::size_t reserved=0;
+		std::size_t used=0;
+		// Blocks waiting for reuse, and bytes that had to come from the heap
+		std::size_t cached=0;
+		std::size_t fallback=0;
+		// Whether the kernel accepted MADV_HUGEPAGE for the regions
+		bool advised=false;
+	};
+	// Process-wide regions reserved with mmap and advised for transparent huge pages, so large pools
+	// sit on few TLB entries. Freed blocks are kept for reuse by size, and everything falls back to
+	// the heap where mmap is missing or fails.
+	class huge_page_region final {
+		static constexpr std::size_t huge_page_size=std::size_t(1)<<21;
+		static constexpr std::size_t region_size=std::size_t(1)<<30;
+		struct region {
+			char* begin;
+			char* end;
+		};
+		std::mutex mLock;
+		std::vector<region> mRegions;
+		char* mBump=nullptr;
+		char* mEnd=nullptr;
+		std::unordered_map<std::size_t,void*> mFree;
+		huge_page_stats mStats;
+		static std::size_t round(std::size_t bytes)
+		{
+			return (std::max<std::size_t>(bytes,1)+63)/64*64;
+		}
+		bool reserve(std::size_t bytes)
+		{
+#ifdef COV_HUGE_PAGES_MMAP
+			std::size_t size=std::max(region_size,(bytes+huge_page_size-1)/huge_page_size*huge_page_size);
+			void* addr=::mmap(nullptr,size+huge_page_size,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,-1,0);
+			if(addr==MAP_FAILED)
+				return false;
+			// Huge pages need 2MB alignment, the slack on both sides is given back
+			char* raw=static_cast<char*>(addr);
+			char* begin=reinterpret_cast<char*>((reinterpret_cast<std::uintptr_t>(raw)+huge_page_size-1)/huge_page_size*huge_page_size);
+			if(begin!=raw)
+				::munmap(raw,begin-raw);
+			if(begin+size!=raw+size+huge_page_size)
+				::munmap(begin+size,raw+size+huge_page_size-(begin+size));
+			if(::madvise(begin,size,MADV_HUGEPAGE)==0)
+				mStats.advised=true;
+			mRegions.push_back({begin,begin+size});
+			mBump=begin;
+			mEnd=begin+size;
+			mStats.reserved+=size;
+			return true;
+#else
+			(void)bytes;
+			return false;
+#endif
+		}
+		bool owns(void* ptr) const
+		{
+			for(auto& r:mRegions)
+				if(ptr>=r.begin&&ptr<r.end)
+					return true;
+			return false;
+		}
+	public:
+		huge_page_region()=default;
+		huge_page_region(const huge_page_region&)=delete;
+		// Never destroyed, pools holding its blocks may outlive every other static
+		static huge_page_region& get()
+		{
+			static huge_page_region* r=new huge_page_region;
+			return *r;
+		}
+		void* allocate(std::size_t bytes)
+		{
+			std::size_t size=round(bytes);
+			{
+				std::lock_guard<std::mutex> guard(mLock);
+				auto it=mFree.find(size);
+				if(it!=mFree.end()&&it->second!=nullptr) {
+					void* ptr=it->second;
+					it->second=*static_cast<void**>(ptr);
+					mStats.cached-=size;
+					return ptr;
+				}
+				if(std::size_t(mEnd-mBump)>=size||reserve(size)) {
+					void* ptr=mBump;
+					mBump+=size;
+					mStats.used+=size;
+					return ptr;
+				}
+				mStats.fallback+=size;
+			}
+			return ::operator new(size);
+		}
+		void deallocate(void* ptr,std::size_t bytes)
+		{
+			std::size_t size=round(bytes);
+			{
+				std::lock_guard<std::mutex> guard(mLock);
+				if(owns(ptr)) {
+					void*& head=mFree[size];
+					*static_cast<void**>(ptr)=head;
+					head=ptr;
+					mStats.cached+=size;
+					return;
+				}
+				mStats.fallback-=size;
+			}
+			::operator delete(ptr);
+		}
+		huge_page_stats stats()
+		{
+			std::lock_guard<std::mutex> guard(mLock);
+			return mStats;
+		}
+	};
+	// Allocator over huge_page_region, for the allocator parameters of storage and the slab pools
+	template<typename T>
+	class huge_page_allocator final {
+	public:
+		typedef T value_type;
+		huge_page_allocator()=default;
+		template<typename X>
+		huge_page_allocator(const huge_page_allocator<X>&) noexcept {}
+		T* allocate(std::size_t n)
+		{
+			return static_cast<T*>(huge_page_region::get().allocate(n*sizeof(T)));
+		}
+		void deallocate(T* ptr,std::size_t n)
+		{
+			huge_page_region::get().deallocate(ptr,n*sizeof(T));
+		}
+		template<typename X,typename...ArgsT>
+		void construct(X* ptr,ArgsT&&...args)
+		{
+			::new(static_cast<void*>(ptr)) X(std::forward<ArgsT>(args)...);
+		}
+		template<typename X>
+		void destroy(X* ptr)
+		{
+			ptr->~X();
+		}
+		template<typename X>
+		bool operator==(const huge_page_allocator<X>&) const noexcept
+		{
+			return true;
+		}
+		template<typename X>
+		bool operator!=(const huge_page_allocator<X>&) const noexcept
+		{
+			return false;
+		}
+	};
+	// Blocks of one size class carved out of contiguous slabs, shared by every type of that class.
+	// Every thread caches free blocks in two magazines of its own, full and empty magazines are
+	// exchanged between threads through a bounded lock-free depot, slabs are only locked to move whole magazines.
+	template<std::size_t block_size,std::size_t mag_size,std::size_t depot_size=64,template<typename>class backing_t=std::allocator>
+	class slab_pool final {
+		static_assert(block_size%16==0,"E000Q");
+		static constexpr std::size_t max_slab_bytes=65536;
+		struct magazine {
+			std::size_t count=0;
+			void* blocks[mag_size];
+		};
+		struct cache {
+			magazine* loaded;
+			magazine* previous;
+			bool flushed;
+		};
+		// Each slot holds at most one magazine and is only ever swapped whole, so there is no ABA hazard
+		struct depot {
+			std::atomic<magazine*> full[depot_size];
+			std::atomic<magazine*> empty[depot_size];
+			std::atomic<std::size_t> blocks {0};
+			depot()
+			{
+				for(std::size_t i=0; i<depot_size; ++i) {
+					full[i]=nullptr;
+					empty[i]=nullptr;
+				}
+			}
+			static bool put(std::atomic<magazine*>* slots,magazine* mag)
+			{
+				for(std::size_t i=0; i<depot_size; ++i) {
+					magazine* expected=nullptr;
+					if(slots[i].load(std::memory_order_relaxed)==nullptr&&slots[i].compare_exchange_strong(expected,mag,std::memory_order_release,std::memory_order_relaxed))
+						return true;
+				}
+				return false;
+			}
+			static magazine* take(std::atomic<magazine*>* slots)
+			{
+				for(std::size_t i=0; i<depot_size; ++i) {
+					if(slots[i].load(std::memory_order_relaxed)!=nullptr) {
+						magazine* mag=slots[i].exchange(nullptr,std::memory_order_acquire);
+						if(mag!=nullptr)
+							return mag;
+					}
+				}
+				return nullptr;
+			}
+		};
+		struct backend {
+			std::mutex lock;
+			std::size_t slab_count=0;
+			std::size_t capacity=0;
+			// Slabs start small and double, so rarely used classes stay cheap
+			std::size_t next_blocks=16;
+			char* bump=nullptr;
+			char* end=nullptr;
+			void* free_list=nullptr;
+			std::size_t free_count=0;
+		};
+		static thread_local cache tls;
+		// Never destroyed, blocks may still be freed while other statics are torn down
+		static depot& get_depot()
+		{
+			static depot* d=new depot;
+			return *d;
+		}
+		static backend& get_backend()
+		{
+			static backend* b=new backend;
+			return *b;
+		}
+		// Take free blocks first, then untouched ones, and open at most one new slab
+		static void fill(magazine* mag)
+		{
+			backend& b=get_backend();
+			bool first=false;
+			{
+				std::lock_guard<std::mutex> guard(b.lock);
+				std::size_t count=mag->count;
+				for(; mag->count<mag_size&&b.free_list!=nullptr; --b.free_count) {
+					mag->blocks[mag->count++]=b.free_list;
+					b.free_list=*static_cast<void**>(b.free_list);
+				}
+				if(mag->count==count&&b.bump==b.end) {
+					std::size_t bytes=b.next_blocks*block_size;
+					b.bump=backing_t<char>().allocate(bytes);
+					b.end=b.bump+bytes;
+					b.capacity+=b.next_blocks;
+					first=b.slab_count++==0;
+					if(b.next_blocks*block_size*2<=max_slab_bytes)
+						b.next_blocks*=2;
+				}
+				for(; mag->count<mag_size&&b.bump!=b.end; b.bump+=block_size)
+					mag->blocks[mag->count++]=b.bump;
+			}
+			if(first)
+				slab_registry::add(stats);
+		}
+		static void drain(magazine* mag)
+		{
+			backend& b=get_backend();
+			std::lock_guard<std::mutex> guard(b.lock);
+			for(; mag->count>0; ++b.free_count) {
+				void* ptr=mag->blocks[--mag->count];
+				*static_cast<void**>(ptr)=b.free_list;
+				b.free_list=ptr;
+			}
+		}
+		static magazine* take_empty()
+		{
+			magazine* mag=depot::take(get_depot().empty);
+			return mag!=nullptr?mag:new magazine;
+		}
+		static void give_empty(magazine* mag)
+		{
+			if(!depot::put(get_depot().empty,mag))
+				delete mag;
+		}
+		static magazine* take_full()
+		{
+			depot& d=get_depot();
+			magazine* mag=depot::take(d.full);
+			if(mag!=nullptr)
+				d.blocks-=mag->count;
+			return mag;
+		}
+		static void give(magazine* mag)
+		{
+			depot& d=get_depot();
+			if(mag->count==0)
+				give_empty(mag);
+			else {
+				d.blocks+=mag->count;
+				if(!depot::put(d.full,mag)) {
+					d.blocks-=mag->count;
+					drain(mag);
+					give_empty(mag);
+				}
+			}
+		}
+		static void flush(cache& c)
+		{
+			if(c.loaded==nullptr)
+				return;
+			give(c.loaded);
+			give(c.previous);
+			c.loaded=nullptr;
+			c.previous=nullptr;
+		}
+		// Lazily set up the magazines of this thread and hand them back when it exits
+		static bool arm(cache& c)
+		{
+			struct sentinel {
+				cache* c;
+				~sentinel()
+				{
+					flush(*c);
+					c->flushed=true;
+				}
+			};
+			if(c.flushed)
+				return false;
+			if(c.loaded==nullptr) {
+				static thread_local sentinel s {&c};
+				(void)s;
+				c.loaded=take_empty();
+				c.previous=take_empty();
+			}
+			return true;
+		}
+		static void* refill(cache& c)
+		{
+			if(!arm(c)) {
+				magazine mag;
+				mag.count=mag_size-1;
+				fill(&mag);
+				return mag.blocks[mag_size-1];
+			}
+			if(c.previous->count==0) {
+				magazine* mag=take_full();
+				if(mag==nullptr)
+					fill(c.previous);
+				else {
+					give_empty(c.previous);
+					c.previous=mag;
+				}
+			}
+			std::swap(c.loaded,c.previous);
+			return c.loaded->blocks[--c.loaded->count];
+		}
+		static void spill(cache& c,void* ptr)
+		{
+			if(!arm(c)) {
+				magazine mag;
+				mag.count=1;
+				mag.blocks[0]=ptr;
+				drain(&mag);
+				return;
+			}
+			if(c.previous->count==mag_size) {
+				give(c.previous);
+				c.previous=take_empty();
+			}
+			std::swap(c.loaded,c.previous);
+			c.loaded->blocks[c.loaded->count++]=ptr;
+		}
+	public:
+		slab_pool()=delete;
+		static void* allocate()
+		{
+			cache& c=tls;
+			if(c.loaded!=nullptr&&c.loaded->count>0)
+				return c.loaded->blocks[--c.loaded->count];
+			return refill(c);
+		}
+		static void deallocate(void* ptr)
+		{
+			cache& c=tls;
+			if(c.loaded!=nullptr&&c.loaded->count<mag_size)
+				c.loaded->blocks[c.loaded->count++]=ptr;
+			else
+				spill(c,ptr);
+		}
+		// Return the magazines of the calling thread to the depot
+		static void clean()
+		{
+			flush(tls);
+		}
+		static slab_stats stats()
+		{
+			backend& b=get_backend();
+			std::lock_guard<std::mutex> guard(b.lock);
+			slab_stats s;
+			s.block_size=block_size;
+			s.slab_count=b.slab_count;
+			s.capacity=b.capacity;
+			s.untouched=(b.end-b.bump)/block_size;
+			s.free=b.free_count+get_depot().blocks;
+			s.outstanding=s.capacity-s.untouched-s.free;
+			return s;
+		}
+	};
+	template<std::size_t block_size,std::size_t mag_size,std::size_t depot_size,template<typename>class backing_t>
+	thread_local typename slab_pool<block_size,mag_size,depot_size,backing_t>::cache slab_pool<block_size,mag_size,depot_size,backing_t>::tls;
+	// Thread-safe variant of allocator, backed by the slab pool of the size class of T
+	template<typename T,std::size_t mag_size,std::size_t depot_size=64,template<typename>class backing_t=std::allocator>
+	class concurrent_allocator final {
+		// Resolved lazily, T may still be incomplete where the allocator is declared
+		template<typename X>
+		struct pool_of {
+			static_assert(alignof(X)<=16,"E000R");
+			using type=slab_pool<slab_size_class(sizeof(X)),mag_size,depot_size,backing_t>;
+		};
+		striped_counter mLive;
+	public:
+		constexpr concurrent_allocator()=default;
+		concurrent_allocator(const concurrent_allocator&)=delete;
+		void clean()
+		{
+			pool_of<T>::type::clean();
+		}
+		slab_stats stats() const
+		{
+			return pool_of<T>::type::stats();
+		}
+		template<typename...ArgsT>
+		T* alloc(ArgsT&&...args)
+		{
+			void* ptr=pool_of<T>::type::allocate();
+			try {
+				::new(ptr) T(std::forward<ArgsT>(args)...);
+			}
+			catch(...) {
+				pool_of<T>::type::deallocate(ptr);
+				throw;
+			}
+			mLive.add(1);
+			return static_cast<T*>(ptr);
+		}
+		void free(T* ptr)
+		{
+			ptr->~T();
+			pool_of<T>::type::deallocate(ptr);
+			mLive.add(-1);
+		}
+		// Objects allocated and not yet freed, counted on every thread
+		std::size_t live() const noexcept
+		{
+			return mLive.get();
+		}
+	};
+	// Bump-pointer region, objects created in it are released in bulk by rewinding to a mark
+	class arena final {
+		struct chunk {
+			chunk* prev;
+			std::size_t size;
+		};
+		struct finalizer {
+			void(*destroy)(void*);
+			void* object;
+			finalizer* prev;
+		};
+		std::size_t mChunkSize;
+		chunk* mChunk=nullptr;
+		// One released chunk is kept, so a frame that rewinds and refills does not hit the heap
+		chunk* mSpare=nullptr;
+		char* mBump=nullptr;
+		char* mEnd=nullptr;
+		finalizer* mFinal=nullptr;
+		static char* begin_of(chunk* c)
+		{
+			return reinterpret_cast<char*>(c+1);
+		}
+		void grow(std::size_t size)
+		{
+			chunk* c=nullptr;
+			if(mSpare!=nullptr&&mSpare->size>=size) {
+				c=mSpare;
+				mSpare=nullptr;
+			}
+			else {
+				size=std::max(size,mChunkSize);
+				c=static_cast<chunk*>(::operator new(sizeof(chunk)+size));
+				c->size=size;
+			}
+			c->prev=mChunk;
+			mChunk=c;
+			mBump=begin_of(c);
+			mEnd=mBump+c->size;
+		}
+		void drop(chunk* c)
+		{
+			if(mSpare==nullptr||mSpare->size<c->size)
+				std::swap(c,mSpare);
+			::operator delete(c);
+		}
+		template<typename T>
+		static void finalize(void* ptr)
+		{
+			static_cast<T*>(ptr)->~T();
+		}
+	public:
+		struct mark {
+			chunk* top;
+			char* bump;
+			finalizer* final;
+		};
+		arena(std::size_t chunk_size=4096):mChunkSize(chunk_size) {}
+		arena(const arena&)=delete;
+		~arena()
+		{
+			release();
+			::operator delete(mSpare);
+		}
+		void* allocate(std::size_t size,std::size_t align=alignof(std::max_align_t))
+		{
+			std::size_t pad=(align-reinterpret_cast<std::uintptr_t>(mBump)%align)%align;
+			if(mChunk==nullptr||std::size_t(mEnd-mBump)<pad+size) {
+				grow(size+align);
+				pad=(align-reinterpret_cast<std::uintptr_t>(mBump)%align)%align;
+			}
+			void* ptr=mBump+pad;
+			mBump+=pad+size;
+			return ptr;
+		}
+		template<typename T,typename...ArgsT>
+		T* create(ArgsT&&...args)
+		{
+			finalizer* final=std::is_trivially_destructible<T>::value?nullptr:static_cast<finalizer*>(allocate(sizeof(finalizer),alignof(finalizer)));
+			T* ptr=::new(allocate(sizeof(T),alignof(T))) T(std::forward<ArgsT>(args)...);
+			if(final!=nullptr) {
+				final->destroy=&finalize<T>;
+				final->object=ptr;
+				final->prev=mFinal;
+				mFinal=final;
+			}
+			return ptr;
+		}
+		// For types whose destructor has no effect even though the compiler cannot prove it, nothing runs on rewind
+		template<typename T,typename...ArgsT>
+		T* create_unmanaged(ArgsT&&...args)
+		{
+			return ::new(allocate(sizeof(T),alignof(T))) T(std::forward<ArgsT>(args)...);
+		}
+		mark get_mark() const noexcept
+		{
+			return {mChunk,mBump,mFinal};
+		}
+		// Destroy every object created after the mark, newest first, and free the chunks opened since
+		void rewind(const mark& m)
+		{
+			for(; mFinal!=m.final; mFinal=mFinal->prev)
+				mFinal->destroy(mFinal->object);
+			while(mChunk!=m.top) {
+				chunk* c=mChunk;
+				mChunk=c->prev;
+				drop(c);
+			}
+			mBump=m.bump;
+			mEnd=mChunk!=nullptr?begin_of(mChunk)+mChunk->size:nullptr;
+		}
+		void release()
+		{
+			rewind({nullptr,nullptr,nullptr});
+		}
+		bool empty() const noexcept
+		{
+			return mChunk==nullptr;
+		}
+	};
+	struct storage_stats final {
+		std::size_t segments=0;
+		std::size_t capacity=0;
+		std::size_t size=0;
+		// Most slots ever in use at once
+		std::size_t peak=0;
+		// Slots waiting on the free list
+		std::size_t free=0;
+		double occupancy() const
+		{
+			return capacity==0?0:double(size)/capacity;
+		}
+	};
+	template<typename T,std::size_t seg_size=1024,template<typename>class allocator_t=std::allocator>
 	class storage final {
+		static constexpr std::size_t npos=std::size_t(-1);
 		struct mem_unit {
-			T* ptr=nullptr;
-			bool raw=true;
+			// Bumped when the slot is freed, so handles to earlier occupants never match
+			std::uint32_t gen=0;
+			// Epoch of the last mark, zero while the slot is free. Slots are born marked so a running collection keeps them
+			std::uint32_t mark=0;
+			std::size_t next=npos;
+		};
+		struct segment {
+			T* data=nullptr;
+			mem_unit* units=nullptr;
 		};
 		allocator_t<T> allocator;
-		array_t<mem_unit,pool_size> pool;
+		allocator_t<mem_unit> unit_allocator;
+		std::vector<segment> segments;
+		std::size_t free_head=npos;
+		std::size_t used=0;
+		std::size_t peak=0;
+		std::uint32_t epoch=1;
+		static bool live(const mem_unit& unit) noexcept
+		{
+			return unit.mark!=0;
+		}
+		// Slots of all segments share one free list, linked by global position
+		void build(std::size_t sid)
+		{
+			segment& seg=segments[sid];
+			seg.data=allocator.allocate(seg_size);
+			if(seg.units==nullptr) {
+				seg.units=unit_allocator.allocate(seg_size);
+				for(std::size_t i=0; i<seg_size; ++i)
+					unit_allocator.construct(seg.units+i);
+			}
+			for(std::size_t i=0; i<seg_size; ++i)
+				seg.units[i].next=i+1<seg_size?sid*seg_size+i+1:free_head;
+			free_head=sid*seg_size;
+		}
+		// Units outlive the data, a rebuilt segment continues their generations
+		void destroy(segment& seg)
+		{
+			for(std::size_t i=0; i<seg_size; ++i) {
+				if(live(seg.units[i])) {
+					allocator.destroy(seg.data+i);
+					++seg.units[i].gen;
+					seg.units[i].mark=0;
+				}
+			}
+			allocator.deallocate(seg.data,seg_size);
+			seg.data=nullptr;
+		}
+		static std::size_t count(const segment& seg)
+		{
+			std::size_t used=0;
+			for(std::size_t i=0; i<seg_size; ++i)
+				if(live(seg.units[i]))
+					++used;
+			return used;
+		}
+		void grow()
+		{
+			for(std::size_t sid=0; sid<segments.size(); ++sid) {
+				if(segments[sid].data==nullptr) {
+					build(sid);
+					return;
+				}
+			}
+			if(extent()+seg_size>std::size_t(std::uint32_t(-1)))
+				throw cov::error("E000N");
+			segments.emplace_back();
+			build(segments.size()-1);
+		}
+		mem_unit& unit_of(std::size_t posit)
+		{
+			if(posit/seg_size>=segments.size())
+				throw cov::error("E000N");
+			return segments[posit/seg_size].units[posit%seg_size];
+		}
+		void release(std::size_t posit)
+		{
+			segment& seg=segments[posit/seg_size];
+			mem_unit& unit=seg.units[posit%seg_size];
+			allocator.destroy(seg.data+posit%seg_size);
+			++unit.gen;
+			unit.mark=0;
+			unit.next=free_head;
+			free_head=posit;
+			--used;
+		}
 	public:
 		class pointer final {
 			friend class storage;
-			std::size_t posit;
-			pointer(std::size_t p):posit(p) {}
+			std::uint32_t posit;
+			std::uint32_t gen;
+			pointer(std::size_t p,std::uint32_t g):posit(p),gen(g) {}
 		public:
 			pointer()=delete;
 			pointer(const pointer&)=default;
 			~pointer()=default;
 			pointer& operator=(const pointer&)=default;
+			bool operator==(const pointer& p) const noexcept
+			{
+				return posit==p.posit&&gen==p.gen;
+			}
+			bool operator!=(const pointer& p) const noexcept
+			{
+				return !(*this==p);
+			}
+			std::size_t index() const noexcept
+			{
+				return posit;
+			}
+			// Unique among every handle this storage ever gave out, up to generation wrap-around
+			std::uint64_t id() const noexcept
+			{
+				return std::uint64_t(gen)<<32|posit;
+			}
 		};
-		storage()
-		{
-			for(auto& unit:pool)
-				unit.ptr=allocator.allocate(1);
-		}
+		storage()=default;
 		storage(const storage&)=delete;
 		~storage()
 		{
-			for(auto& unit:pool) {
-				if(!unit.raw)
-					allocator.destroy(unit.ptr);
-				allocator.deallocate(unit.ptr,1);
+			for(auto& seg:segments) {
+				if(seg.data!=nullptr)
+					destroy(seg);
+				unit_allocator.deallocate(seg.units,seg_size);
 			}
 		}
-		template<typename...ArgsT>
-		pointer alloc(ArgsT...args)
+		// Return segments without live slots to the allocator, handles into other segments stay valid
+		void shrink()
 		{
-			for(std::size_t i=0; i<pool_size; ++i) {
-				if(pool[i].raw) {
-					allocator.construct(pool[i].ptr,std::forward<ArgsT>(args)...);
-					pool[i].raw=false;
-					return i;
+			for(auto& seg:segments)
+				if(seg.data!=nullptr&&count(seg)==0)
+					destroy(seg);
+			free_head=npos;
+			for(std::size_t sid=segments.size(); sid>0; --sid) {
+				segment& seg=segments[sid-1];
+				if(seg.data==nullptr)
+					continue;
+				for(std::size_t i=seg_size; i>0; --i) {
+					if(!live(seg.units[i-1])) {
+						seg.units[i-1].next=free_head;
+						free_head=(sid-1)*seg_size+i-1;
+					}
 				}
 			}
-			throw cov::error("E000M");
 		}
+		std::size_t size() const
+		{
+			return used;
+		}
+		std::size_t capacity() const
+		{
+			std::size_t count=0;
+			for(auto& seg:segments)
+				if(seg.data!=nullptr)
+					count+=seg_size;
+			return count;
+		}
+		storage_stats stats() const
+		{
+			storage_stats s;
+			for(auto& seg:segments)
+				if(seg.data!=nullptr)
+					++s.segments;
+			s.capacity=s.segments*seg_size;
+			s.size=used;
+			s.peak=peak;
+			s.free=s.capacity-used;
+			return s;
+		}
+		// Start a new high-water measurement from the current occupancy
+		void reset_peak() noexcept
+		{
+			peak=used;
+		}
+		template<typename...ArgsT>
+		pointer alloc(ArgsT...args)
+		{
+			if(free_head==npos)
+				grow();
+			std::size_t posit=free_head;
+			segment& seg=segments[posit/seg_size];
+			mem_unit& unit=seg.units[posit%seg_size];
+			allocator.construct(seg.data+posit%seg_size,std::forward<ArgsT>(args)...);
+			free_head=unit.next;
+			unit.mark=epoch;
+			peak=std::max(peak,++used);
+			return pointer(posit,unit.gen);
+		}
+		// Freeing through a stale handle does nothing, the slot may already belong to someone else
 		void free(const pointer& p)
 		{
-			if(p.posit>=pool_size)
-				throw cov::error("E000N");
-			if(!pool[p.posit].raw) {
-				allocator.destroy(pool[p.posit].ptr);
-				pool[p.posit].raw=true;
+			if(unit_of(p.posit).gen==p.gen)
+				release(p.posit);
+		}
+		// Start a mark phase, every live slot counts as unmarked until mark() reaches it
+		void next_epoch() noexcept
+		{
+			if(++epoch==0)
+				epoch=1;
+		}
+		// True if the handle is current and its slot was not marked in this epoch yet
+		bool mark(const pointer& p)
+		{
+			if(p.posit/seg_size>=segments.size())
+				return false;
+			mem_unit& unit=segments[p.posit/seg_size].units[p.posit%seg_size];
+			if(unit.gen!=p.gen||unit.mark==epoch)
+				return false;
+			unit.mark=epoch;
+			return true;
+		}
+		// One past the last slot a sweep has to visit
+		std::size_t extent() const noexcept
+		{
+			return segments.size()*seg_size;
+		}
+		// Free the live slots in [posit,posit+count) not marked in this epoch, returns the next position
+		std::size_t sweep(std::size_t posit,std::size_t count,std::size_t& freed)
+		{
+			std::size_t last=std::min(posit+count,extent());
+			for(; posit<last; ++posit) {
+				segment& seg=segments[posit/seg_size];
+				if(seg.data==nullptr) {
+					posit=(posit/seg_size+1)*seg_size-1;
+					continue;
+				}
+				if(live(seg.units[posit%seg_size])&&seg.units[posit%seg_size].mark!=epoch) {
+					release(posit);
+					++freed;
+				}
 			}
+			return posit;
 		}
 		bool usable(const pointer& p)
 		{
-			if(p.posit>=pool_size)
-				throw cov::error("E000N");
-			return !pool[p.posit].raw;
+			return unit_of(p.posit).gen==p.gen;
 		}
 		T& get(const pointer& p)
 		{
-			if(p.posit>=pool_size)
-				throw cov::error("E000N");
-			if(pool[p.posit].raw)
+			if(unit_of(p.posit).gen!=p.gen)
 				throw cov::error("E000P");
-			return *pool[p.posit].ptr;
+			return segments[p.posit/seg_size].data[p.posit%seg_size];
+		}
+		// No bounds or generation check, only for handles the caller has already verified
+		T& get_unchecked(const pointer& p) noexcept
+		{
+			return segments[p.posit/seg_size].data[p.posit%seg_size];
 		}
 	};
 }
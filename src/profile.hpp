@@ -0,0 +1,135 @@
+#pragma once
+/*
+* Covariant Script: Profile
+* This program is based on Covariant Mozart.
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+* Copyright (C) 2017 Michael Lee(李登淳)
+* Email: mikecovlee@163.com
+* Github: https://github.com/mikecovlee
+*
+* Version: 1.0.0
+*/
+#include "./timer.hpp"
+#include <atomic>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+namespace cs {
+	struct profile_counter final {
+		std::atomic<std::size_t> count {0};
+		std::atomic<cov::timer::timer_t> time {0};
+		void record(cov::timer::timer_t t) noexcept
+		{
+			count.fetch_add(1,std::memory_order_relaxed);
+			time.fetch_add(t,std::memory_order_relaxed);
+		}
+		void reset() noexcept
+		{
+			count=0;
+			time=0;
+		}
+	};
+	struct profile_record final {
+		std::string name;
+		std::size_t count=0;
+		cov::timer::timer_t time=0;
+	};
+	struct profile_thread final {
+		std::size_t id=0;
+		std::size_t slices=0;
+		std::size_t instructions=0;
+		cov::timer::timer_t total_latency=0;
+		cov::timer::timer_t max_latency=0;
+	};
+	struct profile_report final {
+		std::vector<profile_record> types;
+		std::vector<profile_record> instructions;
+		std::vector<profile_thread> threads;
+		std::string to_string() const
+		{
+			std::string str="Instruction Types:\n";
+			for(auto& rec:types)
+				str+="  "+rec.name+"\tcount="+std::to_string(rec.count)+"\ttime="+std::to_string(rec.time)+"ns\n";
+			str+="Instructions:\n";
+			for(auto& rec:instructions)
+				str+="  "+rec.name+"\tcount="+std::to_string(rec.count)+"\ttime="+std::to_string(rec.time)+"ns\n";
+			str+="Threads:\n";
+			for(auto& th:threads)
+				str+="  #"+std::to_string(th.id)+"\tslices="+std::to_string(th.slices)+"\tinstructions="+std::to_string(th.instructions)+"\ttotal_latency="+std::to_string(th.total_latency)+"ns\tmax_latency="+std::to_string(th.max_latency)+"ns\n";
+			return str;
+		}
+		std::string to_json() const
+		{
+			auto dump=[](const std::vector<profile_record>& records) {
+				std::string str="[";
+				for(std::size_t i=0; i<records.size(); ++i) {
+					if(i!=0)
+						str+=",";
+					str+="{\"name\":\""+records[i].name+"\",\"count\":"+std::to_string(records[i].count)+",\"time_ns\":"+std::to_string(records[i].time)+"}";
+				}
+				return str+"]";
+			};
+			std::string str="{\"types\":"+dump(types)+",\"instructions\":"+dump(instructions)+",\"threads\":[";
+			for(std::size_t i=0; i<threads.size(); ++i) {
+				if(i!=0)
+					str+=",";
+				str+="{\"id\":"+std::to_string(threads[i].id)+",\"slices\":"+std::to_string(threads[i].slices)+",\"instructions\":"+std::to_string(threads[i].instructions)+",\"total_latency_ns\":"+std::to_string(threads[i].total_latency)+",\"max_latency_ns\":"+std::to_string(threads[i].max_latency)+"}";
+			}
+			return str+"]}";
+		}
+	};
+	struct gc_report final {
+		// Bucket i counts pauses shorter than 2^i microseconds, the last one also holds everything longer
+		static constexpr std::size_t bucket_count=24;
+		std::size_t cycles=0;
+		std::size_t steps=0;
+		std::size_t marked=0;
+		std::size_t freed=0;
+		cov::timer::timer_t total_pause=0;
+		cov::timer::timer_t max_pause=0;
+		std::vector<std::size_t> pauses=std::vector<std::size_t>(bucket_count,0);
+		void record(cov::timer::timer_t pause)
+		{
+			std::size_t bucket=0;
+			for(cov::timer::timer_t us=pause/1000; us>0&&bucket+1<bucket_count; us/=2)
+				++bucket;
+			++pauses[bucket];
+			++steps;
+			total_pause+=pause;
+			max_pause=std::max(max_pause,pause);
+		}
+		std::string to_string() const
+		{
+			std::string str="cycles="+std::to_string(cycles)+"\tsteps="+std::to_string(steps)+"\tmarked="+std::to_string(marked)+"\tfreed="+std::to_string(freed)+"\ttotal_pause="+std::to_string(total_pause)+"ns\tmax_pause="+std::to_string(max_pause)+"ns\n";
+			str+="Pauses:\n";
+			for(std::size_t i=0; i<pauses.size(); ++i)
+				if(pauses[i]!=0)
+					str+="  <"+std::to_string(std::size_t(1)<<i)+"us\t"+std::to_string(pauses[i])+"\n";
+			return str;
+		}
+		std::string to_json() const
+		{
+			std::string str="{\"cycles\":"+std::to_string(cycles)+",\"steps\":"+std::to_string(steps)+",\"marked\":"+std::to_string(marked)+",\"freed\":"+std::to_string(freed)+",\"total_pause_ns\":"+std::to_string(total_pause)+",\"max_pause_ns\":"+std::to_string(max_pause)+",\"pause_us_buckets\":[";
+			for(std::size_t i=0; i<pauses.size(); ++i) {
+				if(i!=0)
+					str+=",";
+				str+=std::to_string(pauses[i]);
+			}
+			return str+"]}";
+		}
+	};
+}
@@ -1,46 +1,1151 @@
 #include "./core.hpp"
+#include "./bytecode.hpp"
 #include "./timer.hpp"
 #include <iostream>
-class test_calc_ins final:public cs::instruction_base {
-	cs::literal message;
-	mutable std::size_t count=0;
-	mutable cov::timer::timer_t ts=cov::timer::time(cov::timer::time_unit::milli_sec);
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <random>
+#include <limits>
+#include <cmath>
+#include <fstream>
+#include <cstdio>
+class test_noop_ins final:public cs::instruction_base {
 public:
-	test_calc_ins(const cs::literal& msg):message(msg) {}
 	virtual cs::instruction_type type() const override
 	{
 		return cs::instruction_type::calc;
 	}
-	virtual void exec(cs::virtual_machine* vm,cs::thread* th) const override
+	virtual void exec(cs::virtual_machine*,cs::thread*) const override {}
+};
+class test_work_ins final:public cs::instruction_base {
+public:
+	virtual cs::instruction_type type() const override
 	{
-		if(cov::timer::time(cov::timer::time_unit::milli_sec)-ts>=1000) {
-			std::cout<<message<<":"<<count<<std::endl;
-			count=0;
-			ts=cov::timer::time(cov::timer::time_unit::milli_sec);
-		}
-		else
-			++count;
+		return cs::instruction_type::calc;
+	}
+	virtual void exec(cs::virtual_machine*,cs::thread*) const override
+	{
+		volatile std::size_t sum=0;
+		for(std::size_t i=0; i<256; ++i)
+			sum+=i;
+	}
+};
+// Parks the running thread on a wait queue until the host notifies it
+class test_wait_ins final:public cs::instruction_base {
+	cs::wait_queue* mQueue;
+public:
+	explicit test_wait_ins(cs::wait_queue* queue):mQueue(queue) {}
+	virtual cs::instruction_type type() const override
+	{
+		return cs::instruction_type::calc;
+	}
+	virtual void exec(cs::virtual_machine*,cs::thread* th) const override
+	{
+		mQueue->wait(th);
+	}
+};
+class test_tally_ins final:public cs::instruction_base {
+	std::atomic<std::size_t>* mCount;
+public:
+	explicit test_tally_ins(std::atomic<std::size_t>* count):mCount(count) {}
+	virtual cs::instruction_type type() const override
+	{
+		return cs::instruction_type::calc;
+	}
+	virtual void exec(cs::virtual_machine*,cs::thread*) const override
+	{
+		++*mCount;
+	}
+};
+class test_sleepers_ins final:public cs::instruction_base {
+	std::atomic<std::size_t>* mMost;
+public:
+	explicit test_sleepers_ins(std::atomic<std::size_t>* most):mMost(most) {}
+	virtual cs::instruction_type type() const override
+	{
+		return cs::instruction_type::calc;
+	}
+	virtual void exec(cs::virtual_machine* vm,cs::thread*) const override
+	{
+		std::size_t count=vm->sleeping_workers();
+		if(count>mMost->load())
+			mMost->store(count);
 	}
 };
-class test_jmp_ins final:public cs::instruction_base {
+class test_throw_ins final:public cs::instruction_base {
 public:
 	virtual cs::instruction_type type() const override
 	{
-		return cs::instruction_type::jump;
+		return cs::instruction_type::calc;
+	}
+	virtual void exec(cs::virtual_machine*,cs::thread*) const override
+	{
+		throw cs::lang_error("test_throw_ins");
+	}
+};
+bool test_count(cs::var& dst,const cs::var& lhs,const cs::var&)
+{
+	cs::integer count=dst.value<cs::integer>()+1;
+	dst=count;
+	return count<lhs.value<cs::integer>();
+}
+// Integer and floating add unpacked by hand, the way calc functions are written without the operator table
+bool test_add(cs::var& dst,const cs::var& lhs,const cs::var& rhs)
+{
+	if(lhs.type()==typeid(cs::integer)&&rhs.type()==typeid(cs::integer)) {
+		dst=cs::integer(lhs.value<cs::integer>()+rhs.value<cs::integer>());
+		return true;
+	}
+	auto promote=[](const cs::var& v) {
+		return v.type()==typeid(cs::integer)?cs::floating(v.value<cs::integer>()):v.value<cs::floating>();
+	};
+	dst=cs::floating(promote(lhs)+promote(rhs));
+	return true;
+}
+bool test_concat(cs::var& dst,const cs::var& lhs,const cs::var& rhs)
+{
+	std::vector<cs::var> result(lhs.const_val<std::vector<cs::var>>());
+	const std::vector<cs::var>& tail=rhs.const_val<std::vector<cs::var>>();
+	result.insert(result.end(),tail.begin(),tail.end());
+	dst=result;
+	return !result.empty();
+}
+// Behaviour every var representation must share, build with and without CS_COMPACT_VAR to cover both
+// Leaves a temporary of the running thread in the vector held by dst
+bool test_escape(cs::var& dst,const cs::var&,const cs::var&)
+{
+	dst.val<std::vector<cs::var>>().push_back(cs::var::make_temp<std::string>(cs::thread::current()->get_arena(),"escaped"));
+	return false;
+}
+std::size_t check_var()
+{
+	std::size_t failed=0;
+	auto expect=[&failed](bool cond,const char* what) {
+		if(!cond) {
+			std::cerr<<"check_var: "<<what<<" failed"<<std::endl;
+			++failed;
+		}
+	};
+	auto throws=[](const cov::function<void()>& func) {
+		try {
+			func();
+		}
+		catch(const cs::lang_error&) {
+			return true;
+		}
+		return false;
+	};
+	const cs::integer wide=cs::integer(1)<<50;
+	cs::var null,i(cs::integer(-42)),w(wide),f(cs::floating(2.5)),b(cs::boolean(true)),c(cs::character('c')),s(std::string("str"));
+	expect(!null.usable()&&null.type()==typeid(void)&&null.to_string()=="Null","null");
+	expect(null==cs::var()&&null!=i&&i!=null,"null compare");
+	expect(i.type()==typeid(cs::integer)&&i.value<cs::integer>()==-42&&i.to_string()=="-42","integer");
+	expect(w.value<cs::integer>()==wide&&w==cs::var(wide)&&w!=cs::var(wide+1),"wide integer");
+	expect(w.hash()==cs::var(wide).hash()&&i.hash()==std::hash<cs::integer>()(-42),"integer hash");
+	expect(f.type()==typeid(cs::floating)&&f.value<cs::floating>()==2.5&&f==cs::var(cs::floating(2.5)),"floating");
+	cs::floating nan=std::numeric_limits<cs::floating>::quiet_NaN(),inf=std::numeric_limits<cs::floating>::infinity();
+	cs::var vnan(nan),vinf(-inf);
+	expect(vnan.type()==typeid(cs::floating)&&vnan!=vnan&&vinf.value<cs::floating>()==-inf,"floating special values");
+	expect(b.type()==typeid(cs::boolean)&&b.to_string()=="true"&&b==cs::var(true)&&b!=cs::var(false),"boolean");
+	expect(c.type()==typeid(cs::character)&&c.value<cs::character>()=='c'&&c!=cs::var(cs::integer('c')),"character");
+	expect(s.type()==typeid(std::string)&&s.val<std::string>()=="str"&&s==cs::var(std::string("str")),"string");
+	expect(null.type_id()==cs::type_ids::null&&i.type_id()==cs::type_ids::integer&&w.type_id()==cs::type_ids::integer&&f.type_id()==cs::type_ids::floating,"type ids");
+	expect(b.type_id()==cs::type_ids::boolean&&c.type_id()==cs::type_ids::character&&s.type_id()==cs::type_ids::literal,"built-in type ids");
+	cs::var list_id=cs::var::make<std::vector<cs::var>>();
+	expect(list_id.type_id()==cs::type_id_of<std::vector<cs::var>>()&&list_id.type_id()>=cs::type_ids::user&&cs::type_id_of<std::deque<cs::var>>()!=list_id.type_id(),"user type ids");
+	expect(throws([&] {
+		i.val<cs::floating>();
+	})&&throws([&] {
+		s.val<cs::integer>();
+	})&&throws([&] {
+		null.val<cs::integer>();
+	}),"type mismatch throws");
+	// Writes through val() must be seen by every later read, whatever the representation moved the value to
+	cs::var n(cs::integer(1));
+	n.val<cs::integer>()+=wide;
+	expect(n.value<cs::integer>()==wide+1&&n==cs::var(wide+1)&&n.hash()==cs::var(wide+1).hash(),"integer written through val");
+	n.val<cs::integer>()=7;
+	expect(n==cs::var(cs::integer(7))&&cs::var(cs::integer(7))==n,"boxed and inline integer compare");
+	b.val<cs::boolean>()=false;
+	c.val<cs::character>()='d';
+	f.val<cs::floating>()*=2;
+	expect(!b.value<cs::boolean>()&&c.value<cs::character>()=='d'&&f.value<cs::floating>()==5,"scalars written through val");
+	expect(b==cs::var(false)&&c==cs::var(cs::character('d'))&&f==cs::var(cs::floating(5)),"compare after writes through val");
+	// A negative NaN with payload bits set looks like a tagged word unless it is canonicalised
+	f.val<cs::floating>()=-std::nan("281474976710656");
+	expect(f.usable()&&f.type_id()==cs::type_ids::floating&&f.value<cs::floating>()!=f.value<cs::floating>()&&f!=f,"NaN written through val");
+	f=cs::floating(5);
+	// Copies share a holder, reads leave it shared and a write through val() detaches only the writer
+	cs::var text(std::string("str")),shared(text),reader(shared);
+	expect(&shared.const_val<std::string>()==&text.const_val<std::string>()&&reader.value<std::string>()=="str","copies share");
+	shared.val<std::string>()+="ing";
+	expect(shared.const_val<std::string>()=="string"&&text.const_val<std::string>()=="str"&&reader==text&&shared!=text,"write detaches");
+	expect(&reader.const_val<std::string>()==&text.const_val<std::string>(),"other copies stay shared");
+	reader=shared;
+	shared=text;
+	expect(reader.const_val<std::string>()=="string"&&shared==text,"assign between shared holders");
+	// A reference from val() outlives the call, so copies made after it must not see its writes
+	cs::var held(std::string("abc"));
+	std::string& ref=held.val<std::string>();
+	cs::var held_copy(held);
+	ref+="X";
+	expect(held_copy.const_val<std::string>()=="abc"&&held.const_val<std::string>()=="abcX","copy after val does not share");
+	cs::var self_list=cs::var::make<std::vector<cs::var>>();
+	std::vector<cs::var>& items=self_list.val<std::vector<cs::var>>();
+	items.push_back(self_list);
+	items.push_back(i);
+	expect(items.size()==2&&items[0].const_val<std::vector<cs::var>>().empty(),"vector holding itself copies instead of forming a cycle");
+	cs::var written=cs::var::make<std::vector<cs::var>>();
+	written.val<std::vector<cs::var>>().push_back(i);
+	cs::var first(written),second(written),third(second);
+	expect(&first.const_val<std::vector<cs::var>>()!=&written.const_val<std::vector<cs::var>>()&&first==written,"first copy after val takes its own holder");
+	expect(&second.const_val<std::vector<cs::var>>()==&written.const_val<std::vector<cs::var>>()&&&third.const_val<std::vector<cs::var>>()==&written.const_val<std::vector<cs::var>>(),"copies after val share again");
+	cs::var copy(s),moved(std::move(copy));
+	expect(!copy.usable()&&moved==s,"copy and move");
+	moved=i;
+	moved.swap(s);
+	expect(moved.val<std::string>()=="str"&&s==i,"assign and swap");
+	moved=wide;
+	moved=cs::floating(0.5);
+	expect(moved.value<cs::floating>()==0.5,"reassign across types");
+	std::vector<cs::var> arr {i,w,f,b,c,s,null};
+	cs::var list=cs::var::make<std::vector<cs::var>>(arr),list_copy(list);
+	expect(list==list_copy&&list_copy.val<std::vector<cs::var>>()[1]==w,"vector of vars");
+	// Operators: integers wrap, integer and floating promote to floating, strings concatenate and compare
+	const cs::integer max=std::numeric_limits<cs::integer>::max();
+	cs::var two(cs::integer(2)),half(cs::floating(0.5)),str(std::string("str")),yes(true),result;
+	expect(two+two==cs::var(cs::integer(4))&&cs::var(max)+cs::var(cs::integer(1))==cs::var(std::numeric_limits<cs::integer>::min()),"integer add");
+	expect(cs::var(cs::integer(7))/two==cs::var(cs::integer(3))&&cs::var(cs::integer(-7))%two==cs::var(cs::integer(-1)),"integer div and mod");
+	expect(w*two==cs::var(wide*2)&&w-w==cs::var(cs::integer(0)),"wide integer arithmetic");
+	expect((two+half).type_id()==cs::type_ids::floating&&two*half==cs::var(cs::floating(1))&&half<two&&two>=half,"numeric promotion");
+	expect(cs::binary(cs::binary_op::eq,result,two,cs::var(cs::floating(2)))&&result==cs::var(true),"promoted equality");
+	expect(str+cs::var(std::string("ing"))==cs::var(std::string("string"))&&str<cs::var(std::string("t"))&&!(str>str),"string operators");
+	expect(cs::var(cs::character('a'))<cs::var(cs::character('b'))&&!cs::binary(cs::binary_op::ne,result,str,str)&&!cs::binary(cs::binary_op::eq,result,str,two),"comparison fallbacks");
+	expect(throws([&] {
+		cs::var(cs::integer(1))/cs::var(cs::integer(0));
+	})&&throws([&] {
+		yes+yes;
+	})&&throws([&] {
+		str<two;
+	}),"operator errors");
+	cs::var dst(str);
+	cs::calc_binary<cs::binary_op::add>(dst,str,str);
+	expect(dst==cs::var(std::string("strstr"))&&str==cs::var(std::string("str")),"result into a shared holder");
+	expect(cs::calc_binary<cs::binary_op::lt>(result,two,cs::var(cs::integer(3)))&&result==cs::var(true)&&!cs::calc_binary<cs::binary_op::sub>(result,two,two),"calc functions");
+	cs::operator_table::add<std::vector<cs::var>,std::vector<cs::var>>(cs::binary_op::add,test_concat);
+	expect((list+list).const_val<std::vector<cs::var>>().size()==arr.size()*2,"user type operator");
+	const cs::type_id_t late=100000;
+	cs::operator_table::add(cs::binary_op::sub,late,cs::type_ids::integer,test_concat);
+	expect(cs::operator_table::get(cs::binary_op::sub,late,cs::type_ids::integer)==test_concat&&cs::operator_table::get(cs::binary_op::sub,cs::type_ids::integer,late)==nullptr&&cs::operator_table::get(cs::binary_op::add,late,cs::type_ids::integer)==nullptr,"late user type id");
+	expect(cs::operator_table::get(cs::binary_op::add,cs::type_ids::integer,cs::type_ids::integer)!=nullptr&&cs::operator_table::get(cs::binary_op::add,cs::type_ids::boolean,cs::type_ids::boolean)==nullptr,"built-in pairs");
+	cov::arena arena;
+	cs::var ti=cs::var::make_temp<cs::integer>(arena,wide),ts=cs::var::make_temp<std::string>(arena,"tmp");
+	cs::var from_temp(ts);
+	ts.promote();
+	expect(ti.value<cs::integer>()==wide&&!ts.temporary()&&!from_temp.temporary()&&ts.val<std::string>()=="tmp","temporaries");
+	// Whatever a temporary is moved or swapped into may outlive its arena
+	std::vector<cs::var> escaped;
+	{
+		cov::arena scratch;
+		cs::var moved_temp=cs::var::make_temp<std::string>(scratch,"moved");
+		escaped.push_back(std::move(moved_temp));
+		escaped.push_back(cs::var::make_temp<std::string>(scratch,"pushed"));
+		escaped.emplace_back();
+		escaped.back()=cs::var::make_temp<std::string>(scratch,"assigned");
+		cs::var swapped=cs::var::make_temp<std::string>(scratch,"swapped");
+		escaped.emplace_back();
+		escaped.back().swap(swapped);
+	}
+	expect(escaped.size()==4&&std::none_of(escaped.begin(),escaped.end(),[](const cs::var& v) {
+		return v.temporary();
+	}),"temporaries moved into a vector are promoted");
+	expect(escaped[0].const_val<std::string>()=="moved"&&escaped[1].const_val<std::string>()=="pushed"&&escaped[2].const_val<std::string>()=="assigned"&&escaped[3].const_val<std::string>()=="swapped","promoted temporaries read back after the arena is gone");
+	{
+		std::deque<cs::instruction_base*> ins {new cs::instruction_calc(test_escape,0,0,0)};
+		cs::virtual_machine vm;
+		auto th=vm.create_thread(vm.create_code(ins));
+		th->get_register(0)=cs::var::make<std::vector<cs::var>>();
+		th->call(&vm);
+		const std::vector<cs::var>& held=th->get_register(0).const_val<std::vector<cs::var>>();
+		expect(held.size()==1&&!held[0].temporary()&&held[0].const_val<std::string>()=="escaped","temporary pushed by a calc outlives the thread arena");
+		// The frame is pushed before anything made the arena, popping it still frees what came after
+		auto framed=vm.create_thread(vm.create_code(ins));
+		framed->push_frame();
+		{
+			cs::var temp=cs::var::make_temp<std::string>(framed->get_arena(),"framed");
+			expect(temp.temporary()&&!framed->get_arena().empty(),"arena made on first temporary");
+		}
+		framed->pop_frame();
+		bool unbalanced=false;
+		try {
+			framed->pop_frame();
+		}
+		catch(const cs::lang_error&) {
+			unbalanced=true;
+		}
+		expect(framed->get_arena().empty()&&unbalanced,"frame pushed before the arena rewinds it");
+		delete ins.front();
+	}
+	return failed;
+}
+struct test_tracked {
+	static int live;
+	test_tracked()
+	{
+		++live;
 	}
-	virtual void exec(cs::virtual_machine* vm,cs::thread* th) const override
+	test_tracked(const test_tracked&)
 	{
-		th->jump(0);
+		++live;
+	}
+	~test_tracked()
+	{
+		--live;
 	}
 };
-int main()
+int test_tracked::live=0;
+struct test_tracked_counted:public cov::ref_counted<>,public test_tracked {};
+// Move assignment empties the source and releases what the target held right away
+template<typename ptr_t>
+std::size_t check_shared_ptr(const std::string& name)
+{
+	std::size_t failed=0;
+	auto expect=[&failed,&name](bool cond,const char* what) {
+		if(!cond) {
+			std::cerr<<"check_shared_ptr: "<<name<<" "<<what<<" failed"<<std::endl;
+			++failed;
+		}
+	};
+	{
+		ptr_t a=ptr_t::make(),b=ptr_t::make(),c(b);
+		expect(test_tracked::live==2&&b.use_count()==2,"make and copy");
+		b=std::move(a);
+		expect(!a&&b&&b.use_count()==1&&c.use_count()==1&&test_tracked::live==2,"move assignment onto a shared object");
+		c=std::move(b);
+		expect(!b&&c&&c.use_count()==1&&test_tracked::live==1,"move assignment releases the old object");
+		ptr_t d(std::move(c));
+		expect(!c&&d.use_count()==1&&test_tracked::live==1,"move construction");
+	}
+	expect(test_tracked::live==0,"destruction");
+	return failed;
+}
+// Saved code must load back unchanged, and damaged files must be rejected before anything runs
+std::size_t check_bytecode()
 {
+	std::size_t failed=0;
+	auto expect=[&failed](bool cond,const char* what) {
+		if(!cond) {
+			std::cerr<<"check_bytecode: "<<what<<" failed"<<std::endl;
+			++failed;
+		}
+	};
+	const std::string path="check_bytecode.csbc";
+	auto read=[&path] {
+		std::ifstream in(path,std::ios::binary);
+		return std::string(std::istreambuf_iterator<char>(in),std::istreambuf_iterator<char>());
+	};
+	auto write=[&path](const std::string& data) {
+		std::ofstream out(path,std::ios::binary|std::ios::trunc);
+		out.write(data.data(),data.size());
+	};
+	auto rejects=[&path] {
+		try {
+			cs::load_bytecode(path);
+		}
+		catch(const cs::lang_error&) {
+			return true;
+		}
+		return false;
+	};
+	cs::calc_registry::add("test_count",test_count);
+	std::deque<cs::instruction_base*> loop {new cs::instruction_calc(test_count,0,1,2),new cs::instruction_jict(0)};
+	cs::virtual_machine vm;
+	auto code=vm.create_code(loop);
+	cs::save_bytecode(*code,path);
+	auto loaded=cs::load_bytecode(path);
+	expect(loaded->size()==code->size()&&std::memcmp(loaded->records(),code->records(),code->size()*sizeof(cs::instruction_record))==0,"records round trip");
+	expect(loaded->register_count()==code->register_count()&&loaded->calcs().size()==1&&loaded->calcs().get(0)==test_count,"calc table round trip");
+	auto th=vm.create_thread(loaded);
+	th->get_register(0)=cs::var(cs::integer(0));
+	th->get_register(1)=cs::var(cs::integer(10));
+	th->call(&vm);
+	expect(th->get_register(0).value<cs::integer>()==10,"loaded code runs");
+	const std::string image=read();
+	cs::bytecode_header header;
+	std::memcpy(&header,image.data(),sizeof(header));
+	std::string damaged=image;
+	damaged[0]='X';
+	write(damaged);
+	expect(rejects(),"bad magic");
+	write(image.substr(0,sizeof(header)/2));
+	expect(rejects(),"truncated header");
+	damaged=image;
+	header.record_count=image.size();
+	std::memcpy(&damaged[0],&header,sizeof(header));
+	write(damaged);
+	expect(rejects(),"record count beyond the file");
+	// A huge register index would make every thread of the code allocate that many vars
+	damaged=image;
+	cs::instruction_record rec;
+	std::memcpy(&rec,image.data()+header.record_offset,sizeof(rec));
+	rec.dst=0xFFFFFFF0;
+	std::memcpy(&damaged[header.record_offset],&rec,sizeof(rec));
+	write(damaged);
+	expect(rejects(),"register index beyond the limit");
+	std::remove(path.c_str());
+	for(auto ins:loop)
+		delete ins;
+	// Fusion must not change what a program computes. Index 4 is the second half of a pair a later
+	// branch lands in, 6 jumps through a chain into the tag at 0 and 2 leaves through the end
+	std::deque<cs::instruction_base*> branchy {
+		new cs::instruction_tag,
+		new cs::instruction_calc(test_count,0,1,2),
+		new cs::instruction_jicf(13),
+		new cs::instruction_calc(test_count,7,8,2),
+		new cs::instruction_jicf(8),
+		new cs::instruction_calc(test_add,3,3,4),
+		new cs::instruction_jump(12),
+		new cs::instruction_tag,
+		new cs::instruction_calc(test_add,3,3,3),
+		new cs::instruction_calc(test_concat,5,5,6),
+		new cs::instruction_calc(test_count,9,10,2),
+		new cs::instruction_jict(4),
+		new cs::instruction_jump(0)
+	};
+	auto run=[&branchy](bool fusion) {
+		cs::virtual_machine machine;
+		if(fusion)
+			machine.enable_fusion();
+		auto branchy_code=machine.create_code(branchy);
+		auto th=machine.create_thread(branchy_code);
+		const cs::integer init[]= {0,40,0,0,1,0,0,0,5,0,12};
+		for(std::size_t i=0; i<11; ++i)
+			th->get_register(i)=cs::var(init[i]);
+		th->get_register(5)=cs::var::make<std::vector<cs::var>>();
+		th->get_register(6)=cs::var::make<std::vector<cs::var>>(1,cs::var(cs::integer(7)));
+		th->call(&machine);
+		std::vector<cs::var> result;
+		for(std::size_t i=0; i<th->register_count(); ++i)
+			result.push_back(th->get_register(i));
+		result.push_back(cs::var(cs::boolean(th->get_condition())));
+		result.push_back(cs::var(cs::integer(branchy_code->size())));
+		return result;
+	};
+	std::vector<cs::var> plain=run(false),fused=run(true);
+	expect(plain.back().value<cs::integer>()==13&&fused.back().value<cs::integer>()==8,"three pairs fused and both tags dropped");
+	plain.pop_back();
+	fused.pop_back();
+	expect(plain==fused&&plain[0].value<cs::integer>()==40&&plain[5].const_val<std::vector<cs::var>>().size()==35,"fused code leaves the same registers");
+	for(auto ins:branchy)
+		delete ins;
+	return failed;
+}
+// A var the host pins while a cycle is marking survives even when nothing in the pool refers to it any more
+std::size_t check_gc()
+{
+	std::size_t failed=0;
+	auto expect=[&failed](bool cond,const char* what) {
+		if(!cond) {
+			std::cerr<<"check_gc: "<<what<<" failed"<<std::endl;
+			++failed;
+		}
+	};
 	cs::virtual_machine vm;
-	std::ios::sync_with_stdio(false);
-	auto th0=vm.create_thread({new test_calc_ins("th0"),new test_jmp_ins});
-	auto th1=vm.create_thread({new test_calc_ins("th1"),new test_calc_ins("Hello"),new test_jmp_ins});
-	vm.join_thread(th0);
-	vm.join_thread(th1);
+	cs::var_pointer root=vm.create_var(),victim=vm.create_var();
+	vm.pin_var(root);
+	vm.get_var(victim)=cs::var(std::string("victim"));
+	// The victim hangs off the end of a chain, so marking takes many steps to reach it
+	cs::var_pointer tail=root;
+	for(std::size_t i=0; i<4096; ++i) {
+		cs::var_pointer next=vm.create_var();
+		vm.get_var(tail)=cs::var::make<cs::var_pointer>(next);
+		tail=next;
+	}
+	vm.get_var(tail)=cs::var::make<cs::var_pointer>(victim);
+	std::deque<cs::instruction_base*> ins {new cs::instruction_tag};
+	auto code=vm.create_code(ins);
+	auto step=[&] {
+		vm.join_thread(vm.create_thread(code));
+		vm.start();
+	};
+	vm.set_gc_budget(1);
+	vm.set_gc_threshold(1);
+	vm.enable_gc();
+	step();
+	expect(vm.get_gc_phase()==cs::gc_phase::mark,"cycle still marking");
+	vm.pin_var(victim);
+	vm.get_var(tail)=cs::var();
+	while(vm.get_gc_phase()!=cs::gc_phase::idle)
+		step();
+	expect(vm.usable_var(victim)&&vm.get_var(victim).const_val<std::string>()=="victim","var pinned while marking survives");
+	vm.unpin_var(victim);
+	vm.collect();
+	expect(!vm.usable_var(victim)&&vm.usable_var(tail)&&vm.usable_var(root),"unpinned var is collected");
+	std::size_t grown=vm.memory().var_pool.segments;
+	vm.get_var(root)=cs::var();
+	vm.collect();
+	expect(grown>1&&vm.memory().var_pool.segments==1&&!vm.usable_var(tail)&&vm.usable_var(root),"sweep returns emptied segments");
+	delete ins.front();
+	// Storage on its own, with segments small enough to empty by hand
+	cov::storage<std::string,4> pool;
+	std::vector<cov::storage<std::string,4>::pointer> slots;
+	for(std::size_t i=0; i<12; ++i)
+		slots.push_back(pool.alloc(std::to_string(i)));
+	expect(pool.stats().segments==3&&pool.capacity()==12&&pool.size()==12,"storage grows by segments");
+	for(std::size_t i=4; i<8; ++i)
+		pool.free(slots[i]);
+	pool.shrink();
+	expect(pool.stats().segments==2&&pool.size()==8&&pool.get(slots[3])=="3"&&pool.get(slots[8])=="8","shrink keeps handles into other segments");
+	cov::storage<std::string,4>::pointer reused=pool.alloc("reused");
+	expect(reused.index()>=4&&reused.index()<8&&pool.stats().segments==3,"emptied segment is rebuilt on demand");
+	cov::storage<std::string,4>::pointer stale=slots[reused.index()];
+	bool rejected=false;
+	try {
+		pool.get(stale);
+	}
+	catch(const cov::error&) {
+		rejected=true;
+	}
+	pool.free(stale);
+	expect(rejected&&!pool.usable(stale)&&stale!=reused&&pool.get(reused)=="reused","stale handle rejected after its slot is reused");
+	cov::storage<std::string,4>::pointer first=pool.alloc("first");
+	pool.free(first);
+	cov::storage<std::string,4>::pointer second=pool.alloc("second");
+	expect(second.index()==first.index()&&!pool.usable(first)&&pool.get(second)=="second","generation moves on with every free");
+	// A slot is marked once per epoch, and a sweep frees what the epoch did not reach
+	pool.next_epoch();
+	bool once=pool.mark(slots[0])&&!pool.mark(slots[0])&&!pool.mark(stale);
+	cov::storage<std::string,4>::pointer born=pool.alloc("born");
+	std::size_t freed=0;
+	for(std::size_t posit=0; posit<pool.extent();)
+		posit=pool.sweep(posit,5,freed);
+	expect(once&&pool.usable(slots[0])&&pool.usable(born)&&!pool.usable(slots[1])&&pool.size()==2&&freed==9,"mark epoch decides what a sweep frees");
+	pool.next_epoch();
+	expect(pool.mark(slots[0])&&pool.mark(born),"a new epoch marks again");
+	return failed;
+}
+// Holder counts and allocator cache stats are on in every build and show up in the VM snapshot
+std::size_t check_memory()
+{
+	std::size_t failed=0;
+	auto expect=[&failed](bool cond,const char* what) {
+		if(!cond) {
+			std::cerr<<"check_memory: "<<what<<" failed"<<std::endl;
+			++failed;
+		}
+	};
+	cs::virtual_machine vm;
+	auto live=[&vm]() {
+		for(auto& h:vm.memory().holders)
+			if(h.type==typeid(std::string).name())
+				return h.live;
+		return std::size_t(-1);
+	};
+	std::size_t before=live();
+	{
+		cs::var a(std::string("a")),b(std::string("b")),c(a);
+		expect(live()==before+2,"live holders per type");
+	}
+	expect(live()==before,"freed holders are not counted");
+	cov::allocator<test_tracked,4> alloc;
+	test_tracked* ptrs[6];
+	for(auto& ptr:ptrs)
+		ptr=alloc.alloc();
+	for(auto& ptr:ptrs)
+		alloc.free(ptr);
+	alloc.free(alloc.alloc());
+	cs::memory_report report=vm.memory();
+	auto it=std::find_if(report.allocators.begin(),report.allocators.end(),[](const cov::allocator_stats& a) {
+		return a.type==typeid(test_tracked).name();
+	});
+	expect(it!=report.allocators.end()&&it->hits==4&&it->misses==3&&it->offset==3,"allocator cache hits and misses");
+	expect(report.to_json().find("\"allocators\":[")!=std::string::npos,"allocators in the JSON snapshot");
+	return failed;
+}
+std::size_t check_scheduler()
+{
+	std::size_t failed=0;
+	auto expect=[&failed](bool cond,const char* what) {
+		if(!cond) {
+			std::cerr<<"check_scheduler: "<<what<<" failed"<<std::endl;
+			++failed;
+		}
+	};
+	// Threads park on every iteration while another OS thread keeps waking them. No handle is kept,
+	// so a thread is freed by the worker that finishes it, possibly right after it was woken
+	cs::wait_queue queue;
+	std::atomic<std::size_t> tally {0};
+	std::deque<cs::instruction_base*> ins {new test_wait_ins(&queue),new test_tally_ins(&tally),new cs::instruction_calc(test_count,0,1,2),new cs::instruction_jict(0)};
+	const std::size_t threads=64,rounds=200;
+	cs::virtual_machine vm;
+	vm.set_worker_count(4);
+	auto code=vm.create_code(ins);
+	for(std::size_t i=0; i<threads; ++i) {
+		auto th=vm.create_thread(code);
+		th->get_register(0)=cs::var(cs::integer(0));
+		th->get_register(1)=cs::var(cs::integer(rounds));
+		vm.join_thread(th);
+	}
+	std::atomic<bool> done {false};
+	std::thread notifier([&] {
+		while(!done.load())
+			if(queue.notify_all(&vm)==0)
+				std::this_thread::yield();
+	});
 	vm.start();
+	done=true;
+	notifier.join();
+	expect(tally.load()==threads*rounds&&vm.parked_threads()==0,"parallel park and notify");
+	for(auto it:ins)
+		delete it;
+	// Serial and parallel runs of the same threads leave the same registers
+	std::deque<cs::instruction_base*> loop {new cs::instruction_calc(test_add,3,3,0),new cs::instruction_calc(test_count,0,1,2),new cs::instruction_jict(0)};
+	auto run=[&](std::size_t workers) {
+		cs::virtual_machine machine;
+		machine.set_worker_count(workers);
+		machine.set_quantum(7);
+		auto loop_code=machine.create_code(loop);
+		std::vector<std::shared_ptr<cs::thread>> handles;
+		for(std::size_t i=0; i<32; ++i) {
+			auto th=machine.create_thread(loop_code);
+			th->get_register(0)=cs::var(cs::integer(0));
+			th->get_register(1)=cs::var(cs::integer(100+i*37));
+			th->get_register(3)=cs::var(cs::integer(i));
+			machine.join_thread(th);
+			handles.push_back(th);
+		}
+		machine.start();
+		std::vector<cs::integer> result;
+		for(auto& th:handles)
+			result.push_back(th->get_status()==cs::thread_status::finish?th->get_register(3).value<cs::integer>():-1);
+		// Starting again with a new thread brings the workers back up after they shut down
+		auto th=machine.create_thread(loop_code);
+		th->get_register(0)=cs::var(cs::integer(0));
+		th->get_register(1)=cs::var(cs::integer(10));
+		th->get_register(3)=cs::var(cs::integer(0));
+		machine.join_thread(th);
+		machine.start();
+		result.push_back(th->get_register(3).value<cs::integer>());
+		return result;
+	};
+	std::vector<cs::integer> serial=run(1),parallel=run(4);
+	expect(serial==parallel&&serial.size()==33&&std::find(serial.begin(),serial.end(),-1)==serial.end(),"serial and parallel results match");
+	// One thread that throws shuts every worker down and start() rethrows
+	std::deque<cs::instruction_base*> bad {new test_throw_ins};
+	{
+		cs::virtual_machine machine;
+		machine.set_worker_count(4);
+		auto loop_code=machine.create_code(loop);
+		for(std::size_t i=0; i<16; ++i) {
+			auto th=machine.create_thread(loop_code);
+			th->get_register(0)=cs::var(cs::integer(0));
+			th->get_register(1)=cs::var(cs::integer(1000000));
+			th->get_register(3)=cs::var(cs::integer(0));
+			machine.join_thread(th);
+		}
+		machine.join_thread(machine.create_thread(bad));
+		bool thrown=false;
+		try {
+			machine.start();
+		}
+		catch(const cs::lang_error&) {
+			thrown=true;
+		}
+		expect(thrown,"worker error shuts the scheduler down");
+	}
+	// Workers with nothing queued sleep while another worker runs one long thread
+	std::atomic<std::size_t> most {0};
+	std::deque<cs::instruction_base*> watch {new cs::instruction_calc(test_add,3,3,0),new test_sleepers_ins(&most),new cs::instruction_calc(test_count,0,1,2),new cs::instruction_jict(0)};
+	{
+		cs::virtual_machine machine;
+		machine.set_worker_count(4);
+		machine.set_quantum(16);
+		auto th=machine.create_thread(machine.create_code(watch));
+		th->get_register(0)=cs::var(cs::integer(0));
+		th->get_register(1)=cs::var(cs::integer(1000000));
+		th->get_register(3)=cs::var(cs::integer(0));
+		machine.join_thread(th);
+		machine.start();
+		expect(th->get_status()==cs::thread_status::finish&&most.load()==3,"idle workers sleep");
+	}
+	for(auto it:watch)
+		delete it;
+	for(auto it:loop)
+		delete it;
+	delete bad.front();
+	return failed;
+}
+class benchmark final {
+	std::size_t mWarmup=2;
+	std::size_t mRepeat=15;
+	std::string mFilter;
+	bool mFirst=true;
+	static double percentile(const std::vector<double>& sorted,double p)
+	{
+		return sorted[std::min<std::size_t>(sorted.size()-1,p*(sorted.size()-1)+0.5)];
+	}
+public:
+	benchmark(std::size_t warmup,std::size_t repeat,const std::string& filter):mWarmup(warmup),mRepeat(std::max<std::size_t>(repeat,1)),mFilter(filter)
+	{
+		std::cout<<"[";
+	}
+	~benchmark()
+	{
+		std::cout<<"\n]"<<std::endl;
+	}
+	// func runs ops operations and returns the elapsed nanoseconds of its measured region
+	void run(const std::string& name,std::size_t ops,const cov::function<cov::timer::timer_t()>& func)
+	{
+		if(!mFilter.empty()&&name.find(mFilter)==std::string::npos)
+			return;
+		for(std::size_t i=0; i<mWarmup; ++i)
+			func();
+		std::vector<double> samples;
+		for(std::size_t i=0; i<mRepeat; ++i)
+			samples.push_back(double(func())/ops);
+		std::sort(samples.begin(),samples.end());
+		std::cout<<(mFirst?"\n":",\n")<<"{\"name\":\""<<name<<"\",\"ops\":"<<ops<<",\"repeat\":"<<mRepeat
+		         <<",\"min_ns\":"<<samples.front()<<",\"median_ns\":"<<percentile(samples,0.5)<<",\"p90_ns\":"<<percentile(samples,0.9)
+		         <<",\"p99_ns\":"<<percentile(samples,0.99)<<",\"max_ns\":"<<samples.back()<<"}"<<std::flush;
+		mFirst=false;
+	}
+	template<typename T>
+	void measure(const std::string& name,std::size_t ops,T&& func)
+	{
+		run(name,ops,[&func,ops]() {
+			cov::timer::timer_t begin=cov::timer::time(cov::timer::time_unit::nano_sec);
+			func(ops);
+			return cov::timer::time(cov::timer::time_unit::nano_sec)-begin;
+		});
+	}
+};
+void bench_dispatch(benchmark& bench)
+{
+	const std::size_t ops=4000000;
+	std::deque<cs::instruction_base*> native(7,nullptr),invoke(7,nullptr);
+	for(auto& ins:native)
+		ins=new cs::instruction_tag;
+	for(auto& ins:invoke)
+		ins=new test_noop_ins;
+	native.push_back(new cs::instruction_jump(0));
+	invoke.push_back(new cs::instruction_jump(0));
+	for(auto& it: {
+	            std::make_pair("dispatch.native",&native),std::make_pair("dispatch.invoke",&invoke)
+	        }) {
+		cs::virtual_machine vm;
+		auto th=vm.create_thread(*it.second);
+		th->set_status(cs::thread_status::busy);
+		bench.measure(it.first,ops,[&](std::size_t n) {
+			th->exec(&vm,n);
+		});
+	}
+	std::deque<cs::instruction_base*> loop {new cs::instruction_calc(test_count,0,1,2),new cs::instruction_jict(0)};
+	for(bool fusion: {
+	            false,true
+	        }) {
+		cs::virtual_machine vm;
+		if(fusion)
+			vm.enable_fusion();
+		auto code=vm.create_code(loop);
+		bench.run(fusion?"dispatch.calc_loop.fused":"dispatch.calc_loop",ops,[&]() {
+			auto th=vm.create_thread(code);
+			th->get_register(0)=cs::var(cs::integer(0));
+			th->get_register(1)=cs::var(cs::integer(ops/2));
+			cov::timer::timer_t begin=cov::timer::time(cov::timer::time_unit::nano_sec);
+			th->call(&vm);
+			return cov::timer::time(cov::timer::time_unit::nano_sec)-begin;
+		});
+	}
+	for(auto ins:native)
+		delete ins;
+	for(auto ins:invoke)
+		delete ins;
+	for(auto ins:loop)
+		delete ins;
+}
+void bench_var(benchmark& bench)
+{
+	const std::size_t ops=1000000;
+	cs::var a(cs::integer(1)),b(std::string("Covariant Script"));
+	bench.measure("var.construct.integer",ops,[](std::size_t n) {
+		volatile cs::integer sink=0;
+		for(std::size_t i=0; i<n; ++i) {
+			cs::var v((cs::integer(i)));
+			sink=v.value<cs::integer>();
+		}
+		(void)sink;
+	});
+	bench.measure("var.construct.mixed",ops,[](std::size_t n) {
+		std::vector<cs::var> vars;
+		vars.reserve(n);
+		for(std::size_t i=0; i<n; i+=4) {
+			vars.emplace_back(cs::integer(i));
+			vars.emplace_back(cs::character(i));
+			vars.emplace_back(cs::boolean(i%2));
+			vars.emplace_back(cs::floating(i));
+		}
+	});
+	bench.measure("var.copy.integer",ops,[&](std::size_t n) {
+		for(std::size_t i=0; i<n; ++i)
+			cs::var v(a);
+	});
+	bench.measure("var.copy.string",ops,[&](std::size_t n) {
+		for(std::size_t i=0; i<n; ++i)
+			cs::var v(b);
+	});
+	bench.measure("var.assign.integer",ops,[&](std::size_t n) {
+		cs::var v;
+		for(std::size_t i=0; i<n; ++i)
+			v=a;
+	});
+	// Each copy is written to, so a shared holder has to be detached every time
+	bench.measure("var.copy_write.string",ops,[&](std::size_t n) {
+		for(std::size_t i=0; i<n; ++i) {
+			cs::var v(b);
+			v.val<std::string>()[0]='c';
+		}
+	});
+	cs::var vec=cs::var::make<std::vector<cs::var>>(1024,cs::var(std::string("element")));
+	bench.measure("var.copy.vector_1k",10000,[&](std::size_t n) {
+		for(std::size_t i=0; i<n; ++i)
+			cs::var v(vec);
+	});
+	bench.measure("var.val.string",ops,[&](std::size_t n) {
+		volatile std::size_t sink=0;
+		for(std::size_t i=0; i<n; ++i)
+			sink=b.val<std::string>().size();
+		(void)sink;
+	});
+	bench.measure("var.compare.string",ops,[&](std::size_t n) {
+		cs::var v(b);
+		volatile bool result=false;
+		for(std::size_t i=0; i<n; ++i)
+			result=(v==b);
+		(void)result;
+	});
+	bench.measure("var.compare.integer",ops,[&](std::size_t n) {
+		cs::var v(a);
+		volatile bool result=false;
+		for(std::size_t i=0; i<n; ++i)
+			result=(v==a);
+		(void)result;
+	});
+	// Dense numeric arrays, where an inline value saves the holder and the pointer chase
+	for(auto kind: {
+	            0,1
+	        }) {
+		std::vector<cs::var> arr;
+		for(std::size_t i=0; i<ops; ++i)
+			arr.emplace_back(kind==0?cs::var(cs::integer(i)):cs::var(cs::floating(i)));
+		bench.measure(kind==0?"var.array.sum.integer":"var.array.sum.floating",ops,[&](std::size_t n) {
+			volatile cs::floating sink=0;
+			cs::floating sum=0;
+			for(std::size_t i=0; i<n; ++i)
+				sum+=kind==0?cs::floating(arr[i].value<cs::integer>()):arr[i].value<cs::floating>();
+			sink=sum;
+			(void)sink;
+		});
+	}
+	// The same add written by hand and through the operator table, both called like a calc instruction does
+	for(auto& it: {
+	            std::make_pair("integer",cs::var(cs::integer(3))),std::make_pair("mixed",cs::var(cs::floating(3)))
+	        }) {
+		cs::var rhs=it.second;
+		for(auto& calc: {
+		            std::make_pair("var.unpacked.add.",&test_add),std::make_pair("var.binary.add.",&cs::calc_binary<cs::binary_op::add>)
+		        }) {
+			cs::calc_function volatile func=calc.second;
+			bench.measure(std::string(calc.first)+it.first,ops,[&](std::size_t n) {
+				cs::var dst;
+				for(std::size_t i=0; i<n; ++i)
+					func(dst,a,rhs);
+			});
+		}
+	}
+	bench.measure("var.binary.less.string",ops,[&](std::size_t n) {
+		cs::var dst,rhs(std::string("Covariant Script!"));
+		volatile bool sink=false;
+		for(std::size_t i=0; i<n; ++i)
+			sink=cs::calc_binary<cs::binary_op::lt>(dst,b,rhs);
+		(void)sink;
+	});
+	bench.measure("var.temp.integer",ops,[](std::size_t n) {
+		cov::arena arena;
+		volatile cs::integer sink=0;
+		for(std::size_t i=0; i<n; i+=64) {
+			cov::arena::mark frame=arena.get_mark();
+			for(std::size_t j=0; j<64; ++j)
+				sink=cs::var::make_temp<cs::integer>(arena,cs::integer(j)).value<cs::integer>();
+			arena.rewind(frame);
+		}
+		(void)sink;
+	});
+	bench.measure("var.temp.string",ops,[&](std::size_t n) {
+		cov::arena arena;
+		for(std::size_t i=0; i<n; i+=64) {
+			cov::arena::mark frame=arena.get_mark();
+			for(std::size_t j=0; j<64; ++j)
+				cs::var::make_temp<std::string>(arena,b.val<std::string>());
+			arena.rewind(frame);
+		}
+	});
+}
+struct test_counted:public cov::ref_counted<> {
+	cs::integer value=0;
+};
+template<typename ptr_t>
+void bench_shared_ptr(benchmark& bench,const std::string& name)
+{
+	const std::size_t ops=1000000;
+	// Pointers go through a ring of slots so the optimizer cannot fold the count updates away
+	bench.measure(name+".copy",ops,[](std::size_t n) {
+		ptr_t ptr;
+		std::vector<ptr_t> ring(64,ptr);
+		for(std::size_t i=0; i<n; ++i)
+			ring[i%64]=ring[(i+1)%64];
+	});
+	bench.measure(name+".move",ops,[](std::size_t n) {
+		std::vector<ptr_t> ring(64,nullptr);
+		ring[0]=ptr_t();
+		for(std::size_t i=0; i<n; ++i) {
+			ptr_t moved(std::move(ring[i%64]));
+			ring[(i+1)%64]=std::move(moved);
+		}
+	});
+	bench.measure(name+".destroy",ops,[](std::size_t n) {
+		for(std::size_t i=0; i<n; ++i)
+			ptr_t::make();
+	});
+}
+void bench_memory(benchmark& bench)
+{
+	const std::size_t ops=1000000;
+	static cov::allocator<std::string,96> alloc;
+	bench.measure("allocator.alloc_free",ops,[&](std::size_t n) {
+		for(std::size_t i=0; i<n; ++i)
+			alloc.free(alloc.alloc());
+	});
+	bench.measure("allocator.alloc_free.burst64",ops,[&](std::size_t n) {
+		std::string* ptrs[64];
+		for(std::size_t i=0; i<n; i+=64) {
+			for(auto& ptr:ptrs)
+				ptr=alloc.alloc();
+			for(auto& ptr:ptrs)
+				alloc.free(ptr);
+		}
+	});
+	static cov::concurrent_allocator<std::string,96> shared_alloc;
+	bench.measure("allocator.concurrent.alloc_free",ops,[&](std::size_t n) {
+		for(std::size_t i=0; i<n; ++i)
+			shared_alloc.free(shared_alloc.alloc());
+	});
+	for(std::size_t threads: {
+	            2,4
+	        }) {
+		bench.measure("allocator.concurrent.threads_"+std::to_string(threads),ops,[&](std::size_t n) {
+			std::vector<std::thread> workers;
+			for(std::size_t t=0; t<threads; ++t) {
+				workers.emplace_back([&] {
+					std::string* ptrs[64];
+					for(std::size_t i=0; i<n/threads; i+=64) {
+						for(auto& ptr:ptrs)
+							ptr=shared_alloc.alloc();
+						for(auto& ptr:ptrs)
+							shared_alloc.free(ptr);
+					}
+				});
+			}
+			for(auto& th:workers)
+				th.join();
+		});
+	}
+	static cs::var_storage pool;
+	bench.measure("storage.alloc_free.empty",ops,[&](std::size_t n) {
+		for(std::size_t i=0; i<n; ++i)
+			pool.free(pool.alloc());
+	});
+	std::vector<cs::var_pointer> held;
+	for(std::size_t i=0; i<5*cs::var_segment_size; ++i)
+		held.push_back(pool.alloc());
+	bench.measure("storage.alloc_free.half",ops,[&](std::size_t n) {
+		for(std::size_t i=0; i<n; ++i)
+			pool.free(pool.alloc());
+	});
+	bench.measure("storage.get.checked",ops,[&](std::size_t n) {
+		volatile std::size_t sink=0;
+		for(std::size_t i=0; i<n; ++i)
+			sink=sink+pool.get(held[i%held.size()]).usable();
+	});
+	bench.measure("storage.get.unchecked",ops,[&](std::size_t n) {
+		volatile std::size_t sink=0;
+		for(std::size_t i=0; i<n; ++i)
+			sink=sink+pool.get_unchecked(held[i%held.size()]).usable();
+	});
+	for(auto& vptr:held)
+		pool.free(vptr);
+	// Far beyond the reach of the TLB, compare builds with and without CS_HUGE_PAGES
+	std::vector<cs::var_pointer> scattered;
+	for(std::size_t i=0; i<(std::size_t(1)<<21); ++i)
+		scattered.push_back(pool.alloc(cs::var(cs::integer(i))));
+	std::shuffle(scattered.begin(),scattered.end(),std::mt19937(0));
+	bench.measure("storage.random_read.2m",ops,[&](std::size_t n) {
+		volatile cs::integer sink=0;
+		for(std::size_t i=0; i<n; ++i)
+			sink=sink+pool.get(scattered[i%scattered.size()]).value<cs::integer>();
+	});
+	for(auto& vptr:scattered)
+		pool.free(vptr);
+	cs::virtual_machine vm;
+	bench.measure("memory.snapshot",1000,[&](std::size_t n) {
+		volatile std::size_t length=0;
+		for(std::size_t i=0; i<n; ++i)
+			length=vm.memory().to_json().size();
+		(void)length;
+	});
+	bench_shared_ptr<cov::shared_ptr<cs::integer>>(bench,"shared_ptr");
+	bench_shared_ptr<cov::shared_ptr<cs::integer,std::allocator,cov::nonatomic>>(bench,"shared_ptr.nonatomic");
+	bench_shared_ptr<cov::shared_ptr<test_counted>>(bench,"shared_ptr.intrusive");
+}
+void bench_gc(benchmark& bench)
+{
+	const std::size_t ops=20000;
+	// Half of the vars hang off one pinned root in pairs, the other half are unreachable pairs
+	auto build=[](cs::virtual_machine& vm,cs::var_pointer root) {
+		std::vector<cs::var> kids;
+		for(std::size_t i=0; i<ops/4; ++i) {
+			for(bool live: {
+			            true,false
+			        }) {
+				cs::var_pointer a=vm.create_var(),b=vm.create_var();
+				vm.get_var(a)=cs::var::make<cs::var_pointer>(b);
+				vm.get_var(b)=cs::var::make<cs::var_pointer>(a);
+				if(live)
+					kids.push_back(cs::var::make<cs::var_pointer>(a));
+			}
+		}
+		vm.get_var(root)=cs::var::make<std::vector<cs::var>>(kids);
+	};
+	bench.run("gc.collect",ops,[&]() {
+		cs::virtual_machine vm;
+		cs::var_pointer root=vm.create_var();
+		vm.pin_var(root);
+		build(vm,root);
+		cov::timer::timer_t begin=cov::timer::time(cov::timer::time_unit::nano_sec);
+		vm.collect();
+		return cov::timer::time(cov::timer::time_unit::nano_sec)-begin;
+	});
+	// The full cycle again in steps of a 20us budget, stepped the way the serial scheduler does
+	bench.run("gc.incremental.budget_20us",ops,[&]() {
+		cs::virtual_machine vm;
+		cs::var_pointer root=vm.create_var();
+		vm.pin_var(root);
+		build(vm,root);
+		std::deque<cs::instruction_base*> ins {new cs::instruction_tag};
+		auto code=vm.create_code(ins);
+		vm.set_gc_budget(20000);
+		vm.set_gc_threshold(1);
+		vm.enable_gc();
+		vm.reset_gc_profile();
+		do {
+			vm.join_thread(vm.create_thread(code));
+			vm.start();
+		}
+		while(vm.get_gc_phase()!=cs::gc_phase::idle);
+		delete ins.front();
+		return vm.gc_profile().total_pause;
+	});
+}
+void bench_function(benchmark& bench)
+{
+	const std::size_t ops=10000000;
+	volatile std::size_t sink=0;
+	cov::function<std::size_t(std::size_t)> func([](std::size_t x) {
+		return x+1;
+	});
+	bench.measure("function.call",ops,[&](std::size_t n) {
+		for(std::size_t i=0; i<n; ++i)
+			sink=func(i);
+	});
+}
+void bench_scheduler(benchmark& bench)
+{
+	std::deque<cs::instruction_base*> loop(14,nullptr);
+	for(auto& it:loop)
+		it=new cs::instruction_tag;
+	loop.push_back(new cs::instruction_calc(test_count,0,1,2));
+	loop.push_back(new cs::instruction_jict(0));
+	for(std::size_t threads: {
+	            1,100,10000,100000
+	        }) {
+		for(std::size_t quantum: {
+		            1,16
+		        }) {
+			std::size_t loops=std::max<std::size_t>(1000000/(threads*loop.size()),1);
+			bench.run("scheduler.threads_"+std::to_string(threads)+".quantum_"+std::to_string(quantum),threads*loops*loop.size(),[&]() {
+				cs::virtual_machine vm;
+				vm.set_quantum(quantum);
+				auto code=vm.create_code(loop);
+				for(std::size_t i=0; i<threads; ++i) {
+					auto th=vm.create_thread(code);
+					th->get_register(0)=cs::var(cs::integer(0));
+					th->get_register(1)=cs::var(cs::integer(loops));
+					vm.join_thread(th);
+				}
+				cov::timer::timer_t begin=cov::timer::time(cov::timer::time_unit::nano_sec);
+				vm.start();
+				return cov::timer::time(cov::timer::time_unit::nano_sec)-begin;
+			});
+		}
+	}
+	for(auto it:loop)
+		delete it;
+	std::deque<cs::instruction_base*> work(64,nullptr);
+	for(auto& it:work)
+		it=new test_work_ins;
+	for(std::size_t workers: {
+	            1,2,4,8
+	        }) {
+		const std::size_t threads=256;
+		bench.run("scheduler.parallel.workers_"+std::to_string(workers),threads*work.size(),[&]() {
+			cs::virtual_machine vm;
+			vm.set_worker_count(workers);
+			vm.set_quantum(16);
+			auto code=vm.create_code(work);
+			for(std::size_t i=0; i<threads; ++i)
+				vm.join_thread(vm.create_thread(code));
+			cov::timer::timer_t begin=cov::timer::time(cov::timer::time_unit::nano_sec);
+			vm.start();
+			return cov::timer::time(cov::timer::time_unit::nano_sec)-begin;
+		});
+	}
+	for(auto it:work)
+		delete it;
+}
+int main(int args_size,char* args[])
+{
+	std::size_t warmup=2,repeat=15;
+	std::string filter;
+	for(int i=1; i+1<args_size; i+=2) {
+		if(std::strcmp(args[i],"--warmup")==0)
+			warmup=std::strtoul(args[i+1],nullptr,10);
+		else if(std::strcmp(args[i],"--repeat")==0)
+			repeat=std::strtoul(args[i+1],nullptr,10);
+		else if(std::strcmp(args[i],"--filter")==0)
+			filter=args[i+1];
+	}
+	std::size_t failed=check_var()+check_bytecode()+check_gc()+check_memory()+check_scheduler();
+	failed+=check_shared_ptr<cov::shared_ptr<test_tracked>>("shared_ptr");
+	failed+=check_shared_ptr<cov::shared_ptr<test_tracked,std::allocator,cov::nonatomic>>("shared_ptr.nonatomic");
+	failed+=check_shared_ptr<cov::shared_ptr<test_tracked_counted>>("shared_ptr.intrusive");
+	if(failed!=0)
+		return 1;
+	benchmark bench(warmup,repeat,filter);
+	bench_dispatch(bench);
+	bench_var(bench);
+	bench_memory(bench);
+	bench_gc(bench);
+	bench_function(bench);
+	bench_scheduler(bench);
 	return 0;
 }
@@ -25,9 +25,41 @@
 #include "./exceptions.hpp"
 #include "./memory.hpp"
 #include <functional>
+#include <cstring>
+#include <cmath>
+#include <vector>
+#include <deque>
+#include <unordered_map>
 
 namespace cs {
+// Type definition
+	using integer=long;
+#ifdef CS_COMPACT_VAR
+#if defined(__BYTE_ORDER__)&&__BYTE_ORDER__!=__ORDER_LITTLE_ENDIAN__
+#error CS_COMPACT_VAR keeps booleans and characters in the low byte of the word and needs a little-endian target
+#endif
+	// A NaN-boxed var has room for a double but not for a long double
+	using floating=double;
+#else
+	using floating=long double;
+#endif
+	using character=char;
+	using boolean=bool;
+	using literal=std::string;
 	constexpr std::size_t cs_var_pool_size=96;
+// Memory backing the var pool and the holder slabs
+#ifdef CS_HUGE_PAGES
+	template<typename T>using var_backing=cov::huge_page_allocator<T>;
+#else
+	template<typename T>using var_backing=std::allocator<T>;
+#endif
+	struct holder_stats final {
+		// Mangled name of the held type
+		std::string type;
+		std::size_t holder_size=0;
+		std::size_t live=0;
+	};
+	using holder_registry=cov::stats_registry<holder_stats>;
 	template<typename _Tp> class compare_helper {
 		template<typename T,typename X=bool>struct matcher;
 		template<typename T> static constexpr bool match(T*)
@@ -88,6 +120,17 @@ namespace cs {
 	{
 		return to_string_if<T,to_string_helper<T>::value>::to_string(val);
 	}
+	template<> inline std::string to_string<std::string>(const std::string& str)
+	{
+		return str;
+	}
+	template<> inline std::string to_string<bool>(const bool& v)
+	{
+		if(v)
+			return "true";
+		else
+			return "false";
+	}
 	template<typename _Tp> class hash_helper {
 		template<typename T,decltype(&std::hash<T>::operator()) X>struct matcher;
 		template<typename T> static constexpr bool match(T*)
@@ -119,25 +162,147 @@ namespace cs {
 	{
 		return hash_if<T,hash_helper<T>::value>::hash(val);
 	}
+	// Reports the VM vars a value refers to, specialize it for types that hold var_pointer
+	class var_tracer;
+	template<typename T>struct trace_helper {
+		static void trace(const T&,var_tracer&) {}
+	};
+	template<typename T>struct trace_helper<std::vector<T>> {
+		static void trace(const std::vector<T>& vals,var_tracer& t)
+		{
+			for(auto& val:vals)
+				trace_helper<T>::trace(val,t);
+		}
+	};
+	template<typename T>struct trace_helper<std::deque<T>> {
+		static void trace(const std::deque<T>& vals,var_tracer& t)
+		{
+			for(auto& val:vals)
+				trace_helper<T>::trace(val,t);
+		}
+	};
+	// Dense ids of the types a var can hold, hosts may switch on the fixed ids of the built-in types
+	using type_id_t=std::uint32_t;
+	namespace type_ids {
+		constexpr type_id_t null=0;
+		constexpr type_id_t integer=1;
+		constexpr type_id_t boolean=2;
+		constexpr type_id_t character=3;
+		constexpr type_id_t floating=4;
+		constexpr type_id_t literal=5;
+		// Every other type is numbered from here on first use, so the numbers may differ between runs
+		constexpr type_id_t user=6;
+	}
+	inline type_id_t next_type_id() noexcept
+	{
+		static std::atomic<type_id_t> next(type_ids::user);
+		return next.fetch_add(1,std::memory_order_relaxed);
+	}
+	template<typename T>struct type_id_helper {
+		static type_id_t get() noexcept
+		{
+			static const type_id_t id=next_type_id();
+			return id;
+		}
+	};
+	template<type_id_t N>struct fixed_type_id {
+		static constexpr type_id_t get() noexcept
+		{
+			return N;
+		}
+	};
+	template<>struct type_id_helper<void>:fixed_type_id<type_ids::null> {};
+	template<>struct type_id_helper<integer>:fixed_type_id<type_ids::integer> {};
+	template<>struct type_id_helper<boolean>:fixed_type_id<type_ids::boolean> {};
+	template<>struct type_id_helper<character>:fixed_type_id<type_ids::character> {};
+	template<>struct type_id_helper<floating>:fixed_type_id<type_ids::floating> {};
+	template<>struct type_id_helper<literal>:fixed_type_id<type_ids::literal> {};
+	template<typename T>type_id_t type_id_of() noexcept
+	{
+		return type_id_helper<T>::get();
+	}
+	// Scalars small enough to live inside a var instead of a holder, zero means boxed.
+	// A tag is the type id of its type, so the type id of an inline var is its tag.
+	template<typename T>struct inline_tag:std::integral_constant<std::uint8_t,0> {};
+	template<>struct inline_tag<integer>:std::integral_constant<std::uint8_t,type_ids::integer> {};
+	template<>struct inline_tag<boolean>:std::integral_constant<std::uint8_t,type_ids::boolean> {};
+	template<>struct inline_tag<character>:std::integral_constant<std::uint8_t,type_ids::character> {};
+	// long double is wider than a pointer on most targets and stays boxed there
+	constexpr std::uint8_t floating_tag=type_ids::floating;
+	template<>struct inline_tag<floating>:std::integral_constant<std::uint8_t,sizeof(floating)<=sizeof(void*)?floating_tag:0> {};
 	class var final {
 		class baseHolder {
+			// Set in mRefs while a reference from val() may still be in use, the next copy clears it
+			static constexpr std::uint32_t sealed_bit=std::uint32_t(1)<<31;
+			const type_id_t mId;
+			// Vars pointing here, copies share a holder until one of them is written through val()
+			std::atomic<std::uint32_t> mRefs {1};
+		protected:
+			// True when the caller dropped the last reference
+			bool release() noexcept
+			{
+				return (mRefs.fetch_sub(1,std::memory_order_acq_rel)&~sealed_bit)==1;
+			}
 		public:
-			baseHolder() = default;
+			explicit baseHolder(type_id_t id):mId(id) {}
 			virtual ~ baseHolder() = default;
+			type_id_t id() const noexcept
+			{
+				return mId;
+			}
+			bool shared() const noexcept
+			{
+				return (mRefs.load(std::memory_order_acquire)&~sealed_bit)!=1;
+			}
+			// Copies stop sharing this holder, a reference into it must not reach them. Only the var
+			// that owns the unshared holder calls this, so a plain store is enough
+			void seal() noexcept
+			{
+				std::uint32_t refs=mRefs.load(std::memory_order_relaxed);
+				if(!(refs&sealed_bit))
+					mRefs.store(refs|sealed_bit,std::memory_order_relaxed);
+			}
+			// The holder a copy of the var points to. The first copy of a sealed holder gets its own,
+			// which covers a reference used across that copy such as pushing a vector var into itself,
+			// and later copies share again so one val() costs at most one deep copy
+			virtual baseHolder* share()
+			{
+				if(mRefs.load(std::memory_order_relaxed)&sealed_bit) {
+					baseHolder* copy=duplicate();
+					mRefs.fetch_and(~sealed_bit,std::memory_order_relaxed);
+					return copy;
+				}
+				mRefs.fetch_add(1,std::memory_order_relaxed);
+				return this;
+			}
 			virtual const std::type_info& type() const = 0;
 			virtual baseHolder* duplicate() = 0;
 			virtual bool compare(const baseHolder *) const = 0;
 			virtual std::string to_string() const = 0;
 			virtual std::size_t hash() const = 0;
 			virtual void kill() = 0;
+			virtual void trace(var_tracer&) const = 0;
+			virtual bool temporary() const
+			{
+				return false;
+			}
 		};
 		template<typename T>class holder:public baseHolder {
 		protected:
 			T mDat;
 		public:
-			static cov::allocator<holder<T>,cs_var_pool_size> allocator;
-			holder() = default;
-			template<typename...ArgsT>holder(ArgsT&&...args):mDat(std::forward<ArgsT>(args)...) {}
+			static cov::concurrent_allocator<holder<T>,cs_var_pool_size,64,var_backing> allocator;
+			static const bool registered;
+			static holder_stats stats()
+			{
+				holder_stats s;
+				s.type=typeid(T).name();
+				s.holder_size=sizeof(holder<T>);
+				s.live=allocator.live();
+				return s;
+			}
+			holder():baseHolder(type_id_of<T>()) {}
+			template<typename...ArgsT>holder(ArgsT&&...args):baseHolder(type_id_of<T>()),mDat(std::forward<ArgsT>(args)...) {}
 			virtual ~ holder() = default;
 			virtual const std::type_info& type() const override
 			{
@@ -149,11 +314,7 @@ namespace cs {
 			}
 			virtual bool compare(const baseHolder* obj) const override
 			{
-				if (obj->type()==this->type()) {
-					const holder<T>* ptr=dynamic_cast<const holder<T>*>(obj);
-					return ptr!=nullptr?cs::compare(mDat,ptr->data()):false;
-				}
-				return false;
+				return obj->id()==this->id()&&cs::compare(mDat,static_cast<const holder<T>*>(obj)->data());
 			}
 			virtual std::string to_string() const override
 			{
@@ -165,7 +326,13 @@ namespace cs {
 			}
 			virtual void kill() override
 			{
-				allocator.free(this);
+				(void)&registered;
+				if(this->release())
+					allocator.free(this);
+			}
+			virtual void trace(var_tracer& t) const override
+			{
+				trace_helper<T>::trace(mDat,t);
 			}
 			T& data()
 			{
@@ -180,106 +347,496 @@ namespace cs {
 				mDat = dat;
 			}
 		};
-		baseHolder* mDat=nullptr;
-		var(baseHolder* ptr):mDat(ptr) {}
+		// Lives in an arena that destroys it in bulk, copies are made in the normal pool
+		template<typename T>class temp_holder final:public holder<T> {
+		public:
+			using holder<T>::holder;
+			virtual baseHolder* share() override
+			{
+				return this->duplicate();
+			}
+			virtual void kill() override {}
+			virtual bool temporary() const override
+			{
+				return true;
+			}
+		};
+#ifdef CS_COMPACT_VAR
+		// One NaN-boxed word: a double is stored as it is, every other kind lives in the quiet NaN space
+		// from tag_base up, with the tag in the top 16 bits and the payload in the low 48 bits.
+		// Null is a holder pointer of zero.
+		static constexpr std::uint64_t tag_base=0xFFF9;
+		static constexpr std::uint64_t payload_mask=(std::uint64_t(1)<<48)-1;
+		alignas(std::uint64_t) unsigned char mBuf[sizeof(std::uint64_t)];
+		std::uint64_t word() const noexcept
+		{
+			std::uint64_t w;
+			std::memcpy(&w,mBuf,sizeof(w));
+			return w;
+		}
+		void word(std::uint64_t w) noexcept
+		{
+			std::memcpy(mBuf,&w,sizeof(w));
+		}
+		std::uint8_t tag() const noexcept
+		{
+			std::uint64_t top=word()>>48;
+			return top>=tag_base?std::uint8_t(top-tag_base):floating_tag;
+		}
+		baseHolder* ptr() const noexcept
+		{
+			return reinterpret_cast<baseHolder*>(std::uintptr_t(word()&payload_mask));
+		}
+		void set_ptr(baseHolder* p) noexcept
+		{
+			word(tag_base<<48|std::uint64_t(reinterpret_cast<std::uintptr_t>(p)));
+		}
+		// Integers wider than 48 bits are boxed
+		template<typename T>static bool fits(const T&) noexcept
+		{
+			return true;
+		}
+		static bool fits(integer dat) noexcept
+		{
+			return dat>=-(integer(1)<<47)&&dat<(integer(1)<<47);
+		}
+		void store(integer dat) noexcept
+		{
+			word((tag_base+inline_tag<integer>::value)<<48|(std::uint64_t(dat)&payload_mask));
+		}
+		void store(boolean dat) noexcept
+		{
+			word((tag_base+inline_tag<boolean>::value)<<48|std::uint64_t(dat));
+		}
+		void store(character dat) noexcept
+		{
+			word((tag_base+inline_tag<character>::value)<<48|std::uint64_t(static_cast<unsigned char>(dat)));
+		}
+		// Every NaN is stored as the positive quiet NaN so that none of them reads as a tag
+		void store(floating dat) noexcept
+		{
+			if(dat!=dat)
+				word(0x7FF8000000000000);
+			else
+				std::memcpy(mBuf,&dat,sizeof(dat));
+		}
+		template<typename T>T inline_get(T*) const noexcept
+		{
+			T dat;
+			std::memcpy(&dat,mBuf,sizeof(T));
+			return dat;
+		}
+		integer inline_get(integer*) const noexcept
+		{
+			return integer(std::int64_t(word()<<16)>>16);
+		}
+		template<typename T>T inline_get() const noexcept
+		{
+			return inline_get(static_cast<T*>(nullptr));
+		}
+		// The 48-bit integer cannot be referenced as a long, and a double written through a reference
+		// would skip the NaN canonicalisation in store(), booleans and characters sit in the low byte
+		template<typename T>using addressable=std::integral_constant<bool,!std::is_same<T,integer>::value&&!std::is_same<T,floating>::value>;
+		// Integers that do not fit, or scalars written through val(), are held boxed
+		static constexpr bool boxes_inline_types=true;
+		void copy_payload(const var& v) noexcept
+		{
+			std::memcpy(mBuf,v.mBuf,sizeof(mBuf));
+		}
+		void swap_payload(var& v) noexcept
+		{
+			std::uint64_t w=word();
+			word(v.word());
+			v.word(w);
+		}
+#else
+		union {
+			baseHolder* mDat;
+			alignas(void*) unsigned char mBuf[sizeof(void*)];
+		};
+		// Zero when mDat is a holder pointer or null
+		std::uint8_t mTag;
+		std::uint8_t tag() const noexcept
+		{
+			return mTag;
+		}
+		baseHolder* ptr() const noexcept
+		{
+			return mDat;
+		}
+		void set_ptr(baseHolder* p) noexcept
+		{
+			mDat=p;
+			mTag=0;
+		}
+		template<typename T>static constexpr bool fits(const T&) noexcept
+		{
+			return true;
+		}
+		template<typename T>void store(const T& dat) noexcept
+		{
+			mDat=nullptr;
+			::new(mBuf) T(dat);
+			mTag=inline_tag<T>::value;
+		}
+		template<typename T>T inline_get() const noexcept
+		{
+			return *reinterpret_cast<const T*>(mBuf);
+		}
+		template<typename T>using addressable=std::true_type;
+		static constexpr bool boxes_inline_types=false;
+		void copy_payload(const var& v) noexcept
+		{
+			std::memcpy(mBuf,v.mBuf,sizeof(mBuf));
+			mTag=v.mTag;
+		}
+		void swap_payload(var& v) noexcept
+		{
+			unsigned char buf[sizeof(mBuf)];
+			std::memcpy(buf,mBuf,sizeof(buf));
+			std::memcpy(mBuf,v.mBuf,sizeof(buf));
+			std::memcpy(v.mBuf,buf,sizeof(buf));
+			std::swap(mTag,v.mTag);
+		}
+#endif
+		var(baseHolder* p) noexcept
+		{
+			set_ptr(p);
+		}
+		template<typename T>T& inline_ref(std::true_type) noexcept
+		{
+			return *reinterpret_cast<T*>(mBuf);
+		}
+		// No lvalue of T inside the var, so move the value into a holder first
+		template<typename T>T& inline_ref(std::false_type)
+		{
+			set_ptr(holder<T>::allocator.alloc(inline_get<T>()));
+			ptr()->seal();
+			return static_cast<holder<T>*>(ptr())->data();
+		}
+		template<typename T>T& inline_ref()
+		{
+			return inline_ref<T>(addressable<T>());
+		}
+		template<typename T>const T& inline_cref(std::true_type) const noexcept
+		{
+			return *reinterpret_cast<const T*>(mBuf);
+		}
+		template<typename T>T inline_cref(std::false_type) const noexcept
+		{
+			return inline_get<T>();
+		}
+		template<typename T,typename...ArgsT>void emplace(std::true_type,ArgsT&&...args)
+		{
+			T dat=T(std::forward<ArgsT>(args)...);
+			if(fits(dat))
+				store(dat);
+			else
+				set_ptr(holder<T>::allocator.alloc(dat));
+		}
+		template<typename T,typename...ArgsT>void emplace(std::false_type,ArgsT&&...args)
+		{
+			set_ptr(holder<T>::allocator.alloc(std::forward<ArgsT>(args)...));
+		}
+		template<typename T>using is_inline=std::integral_constant<bool,inline_tag<T>::value!=0>;
+		// Calls f with the inline value as its own type, the tag must not be zero
+		template<typename F>auto visit_inline(F&& f) const->decltype(f(integer()))
+		{
+			switch(tag()) {
+			case inline_tag<boolean>::value:
+				return f(inline_get<boolean>());
+			case inline_tag<character>::value:
+				return f(inline_get<character>());
+			case floating_tag:
+				return f(inline_get<floating>());
+			default:
+				return f(inline_get<integer>());
+			}
+		}
+		struct type_visitor {
+			template<typename T>const std::type_info& operator()(T) const
+			{
+				return typeid(T);
+			}
+		};
+		struct to_string_visitor {
+			template<typename T>std::string operator()(T val) const
+			{
+				return cs::to_string(val);
+			}
+		};
+		struct hash_visitor {
+			template<typename T>std::size_t operator()(T val) const
+			{
+				return cs::hash<T>(val);
+			}
+		};
+		// In the compact layout an integer may be inline on one side and boxed on the other
+		struct boxed_compare_visitor {
+			const var& other;
+			template<typename T>bool operator()(T val) const
+			{
+				return other.boxed()&&other.ptr()->id()==type_id_of<T>()&&val==static_cast<holder<T>*>(other.ptr())->data();
+			}
+		};
+		bool boxed() const noexcept
+		{
+			return tag()==0&&ptr()!=nullptr;
+		}
+		// Inline integers, booleans and characters are equal exactly when their payload bits are,
+		// every store clears the bytes a narrower value leaves unused
+		bool same_payload(const var& v) const noexcept
+		{
+			return std::memcmp(mBuf,v.mBuf,sizeof(mBuf))==0;
+		}
+		// Vars with different tags, only equal when one side holds the other's inline type boxed
+		bool compare_mixed(const var& v) const
+		{
+			if(!boxes_inline_types)
+				return false;
+			if(tag()==0)
+				return v.visit_inline(boxed_compare_visitor {*this});
+			if(v.tag()==0)
+				return visit_inline(boxed_compare_visitor {v});
+			return false;
+		}
+		template<typename T>T value(std::true_type) const
+		{
+			if(tag()==inline_tag<T>::value)
+				return inline_get<T>();
+			return const_val<T>();
+		}
+		template<typename T>T value(std::false_type) const
+		{
+			return const_val<T>();
+		}
+		// Kept out of the typed accessors so that they stay small enough to inline
+		static void type_mismatch()
+		{
+			throw lang_error("CSLE0006");
+		}
+		template<typename T>void check_inline() const
+		{
+			if(!is_inline<T>::value||tag()!=inline_tag<T>::value)
+				type_mismatch();
+		}
+		template<typename T>baseHolder* checked_holder() const
+		{
+			baseHolder* p=ptr();
+			if(p==nullptr||p->id()!=type_id_of<T>())
+				type_mismatch();
+			return p;
+		}
+		// Gives this var its own copy of a shared holder before it is written to
+		baseHolder* detach()
+		{
+			baseHolder* p=ptr()->duplicate();
+			ptr()->kill();
+			set_ptr(p);
+			return p;
+		}
 	public:
-		void swap(var& obj)
+		// Moves and swaps promote a temporary, whatever it lands in may outlive the arena
+		void swap(var& obj) noexcept
 		{
-			std::swap(this->mDat,obj.mDat);
+			swap_payload(obj);
+			promote();
+			obj.promote();
 		}
 		void swap(var&& obj) noexcept
 		{
-			std::swap(this->mDat,obj.mDat);
+			swap(obj);
 		}
 		bool usable() const noexcept
 		{
-			return mDat!=nullptr;
+			return tag()!=0||ptr()!=nullptr;
 		}
 		template<typename T,typename...ArgsT>static var make(ArgsT&&...args)
 		{
-			return var(holder<T>::allocator.alloc(std::forward<ArgsT>(args)...));
+			var v;
+			v.emplace<T>(is_inline<T>(),std::forward<ArgsT>(args)...);
+			return v;
+		}
+		// The value is only valid until the arena is rewound past it. Copies, moves and promote() put it in the
+		// normal pool, so only the var returned here ever refers to the arena
+		template<typename T,typename...ArgsT>static var make_temp(cov::arena& a,ArgsT&&...args)
+		{
+			if(is_inline<T>::value)
+				return make<T>(std::forward<ArgsT>(args)...);
+			else if(std::is_trivially_destructible<T>::value)
+				return var(static_cast<baseHolder*>(a.create_unmanaged<temp_holder<T>>(std::forward<ArgsT>(args)...)));
+			else
+				return var(static_cast<baseHolder*>(a.create<temp_holder<T>>(std::forward<ArgsT>(args)...)));
+		}
+		bool temporary() const noexcept
+		{
+			return boxed()&&ptr()->temporary();
+		}
+		void promote()
+		{
+			if(temporary())
+				set_ptr(ptr()->duplicate());
+		}
+		var() noexcept
+		{
+			set_ptr(nullptr);
+		}
+		template<typename T> explicit var(const T & dat)
+		{
+			emplace<T>(is_inline<T>(),dat);
+		}
+		var(const var& v)
+		{
+			if(v.boxed())
+				set_ptr(v.ptr()->share());
+			else
+				copy_payload(v);
 		}
-		var()=default;
-		template<typename T> explicit var(const T & dat):mDat(holder<T>::allocator.alloc(dat)) {}
-		var(const var& v):mDat(v.mDat==nullptr?nullptr:v.mDat->duplicate()) {}
 		var(var&& v) noexcept
 		{
-			swap(std::forward<var>(v));
+			set_ptr(nullptr);
+			swap_payload(v);
+			promote();
 		}
 		~var()
 		{
-			delete mDat;
+			if(boxed())
+				ptr()->kill();
 		}
 		const std::type_info& type() const
 		{
-			return this->mDat!=nullptr?this->mDat->type():typeid(void);
+			if(tag()!=0)
+				return visit_inline(type_visitor());
+			return ptr()!=nullptr?ptr()->type():typeid(void);
+		}
+		type_id_t type_id() const noexcept
+		{
+			if(tag()!=0)
+				return tag();
+			return ptr()!=nullptr?ptr()->id():type_ids::null;
 		}
 		std::string to_string() const
 		{
-			if(this->mDat==nullptr)
+			if(tag()!=0)
+				return visit_inline(to_string_visitor());
+			if(ptr()==nullptr)
 				return "Null";
-			return this->mDat->to_string();
+			return ptr()->to_string();
 		}
 		std::size_t hash() const
 		{
-			if(this->mDat==nullptr)
+			if(tag()!=0)
+				return visit_inline(hash_visitor());
+			if(ptr()==nullptr)
 				return cs::hash<void*>(nullptr);
-			return this->mDat->hash();
+			return ptr()->hash();
+		}
+		void trace(var_tracer& t) const
+		{
+			if(boxed())
+				ptr()->trace(t);
 		}
 		var& operator=(const var& v)
 		{
 			if(&v!=this) {
-				if(mDat!=nullptr)
-					mDat->kill();
-				mDat=v.mDat==nullptr?nullptr:v.mDat->duplicate();
+				baseHolder* old=boxed()?ptr():nullptr;
+				if(v.boxed())
+					set_ptr(v.ptr()->share());
+				else
+					copy_payload(v);
+				if(old!=nullptr)
+					old->kill();
 			}
 			return *this;
 		}
 		var& operator=(var&& v) noexcept
 		{
-			swap(std::forward<var>(v));
+			swap_payload(v);
+			promote();
+			v.promote();
 			return *this;
 		}
 		template<typename T> var& operator=(const T& dat)
 		{
-			if(mDat!=nullptr)
-				mDat->kill();
-			mDat=holder<T>::allocator.alloc(dat);
+			// Overwrite a holder of the same type in place when no other var or arena depends on it
+			if(!is_inline<T>::value&&boxed()&&ptr()->id()==type_id_of<T>()&&!ptr()->shared()&&!ptr()->temporary()) {
+				static_cast<holder<T>*>(ptr())->data()=dat;
+				return *this;
+			}
+			if(boxed())
+				ptr()->kill();
+			emplace<T>(is_inline<T>(),dat);
 			return *this;
 		}
 		bool operator==(const var& v) const
 		{
-			return usable()?this->mDat->compare(v.mDat):!v.usable();
+			if(tag()==v.tag()) {
+				if(tag()==floating_tag)
+					return inline_get<floating>()==v.inline_get<floating>();
+				if(tag()!=0)
+					return same_payload(v);
+				if(ptr()==nullptr||v.ptr()==nullptr)
+					return ptr()==v.ptr();
+				return ptr()->compare(v.ptr());
+			}
+			return compare_mixed(v);
 		}
 		bool operator!=(const var& v)const
 		{
-			return usable()?!this->mDat->compare(v.mDat):v.usable();
+			return !(*this==v);
+		}
+		// What read-only access returns, a copy where the layout has no T to refer to
+		template<typename T>using const_ref=typename std::conditional<addressable<T>::value,const T&,T>::type;
+		// Writable access, copies a holder shared with other vars first. The holder is sealed so that
+		// the next copy of this var gets its own and the reference cannot write into it. A scalar
+		// the layout cannot address (see addressable) is moved into a holder for good, so hot paths
+		// that only read or overwrite scalars should use value() and operator= instead
+		template<typename T> T& val()
+		{
+			if(tag()!=0) {
+				check_inline<T>();
+				return inline_ref<T>();
+			}
+			baseHolder* p=checked_holder<T>();
+			if(p->shared())
+				p=detach();
+			p->seal();
+			return static_cast<holder<T>*>(p)->data();
+		}
+		template<typename T> const_ref<T> val() const
+		{
+			return const_val<T>();
+		}
+		// Read-only access that leaves a shared holder shared and never boxes an inline value
+		template<typename T> const_ref<T> const_val() const
+		{
+			if(tag()!=0) {
+				check_inline<T>();
+				return inline_cref<T>(addressable<T>());
+			}
+			return static_cast<const holder<T>*>(checked_holder<T>())->data();
 		}
-		template<typename T> T& val() const
+		// Reads a copy, unlike val() it never has to move an inline value into a holder
+		template<typename T> T value() const
 		{
-			if(typeid(T)!=this->type())
-				throw lang_error("CSLE0006");
-			if(this->mDat==nullptr)
-				throw lang_error("CSLE0005");
-			return dynamic_cast<const holder<T>*>(this->mDat)->data();
+			return value<T>(is_inline<T>());
 		}
-		template<typename T> operator T&() const
+		template<typename T> operator T&()
 		{
 			return this->val<T>();
 		}
 	};
-	template<> std::string to_string<std::string>(const std::string& str)
-	{
-		return str;
-	}
-	template<> std::string to_string<bool>(const bool& v)
-	{
-		if(v)
-			return "true";
-		else
-			return "false";
-	}
-	template<typename T> cov::allocator<var::holder<T>,cs_var_pool_size> var::holder<T>::allocator;
+#ifdef CS_COMPACT_VAR
+	static_assert(sizeof(var)==sizeof(std::uint64_t),"compact var must be a single word");
+#endif
+	template<>struct trace_helper<var> {
+		static void trace(const var& val,var_tracer& t)
+		{
+			val.trace(t);
+		}
+	};
+	template<typename T> cov::concurrent_allocator<var::holder<T>,cs_var_pool_size,64,var_backing> var::holder<T>::allocator;
+	template<typename T> const bool var::holder<T>::registered=(holder_registry::add(&var::holder<T>::stats),true);
 	template<int N> class var::holder<char[N]>:public var::holder<std::string> {
 	public:
 		using holder<std::string>::holder;
@@ -288,4 +845,294 @@ namespace cs {
 	public:
 		using holder<std::type_index>::holder;
 	};
+// Binary operators
+	enum class binary_op : std::uint8_t {
+		add,sub,mul,div,mod,lt,le,gt,ge,eq,ne
+	};
+	constexpr std::size_t binary_op_count=11;
+	// Writes the result to dst and returns its truth, so every handler is also a calc function
+	using binary_handler=bool(*)(var&,const var&,const var&);
+	// The operation on two operands already converted to their common type.
+	// Integer arithmetic wraps around instead of overflowing.
+	template<binary_op op>struct binary_impl;
+	template<>struct binary_impl<binary_op::add> {
+		static integer apply(integer a,integer b) noexcept
+		{
+			return integer(std::make_unsigned<integer>::type(a)+std::make_unsigned<integer>::type(b));
+		}
+		template<typename T>static T apply(const T& a,const T& b)
+		{
+			return a+b;
+		}
+	};
+	template<>struct binary_impl<binary_op::sub> {
+		static integer apply(integer a,integer b) noexcept
+		{
+			return integer(std::make_unsigned<integer>::type(a)-std::make_unsigned<integer>::type(b));
+		}
+		template<typename T>static T apply(const T& a,const T& b)
+		{
+			return a-b;
+		}
+	};
+	template<>struct binary_impl<binary_op::mul> {
+		static integer apply(integer a,integer b) noexcept
+		{
+			return integer(std::make_unsigned<integer>::type(a)*std::make_unsigned<integer>::type(b));
+		}
+		template<typename T>static T apply(const T& a,const T& b)
+		{
+			return a*b;
+		}
+	};
+	template<>struct binary_impl<binary_op::div> {
+		static integer apply(integer a,integer b)
+		{
+			if(b==0)
+				throw lang_error("CSLE0018");
+			// The smallest integer divided by -1 would overflow
+			if(b==-1)
+				return binary_impl<binary_op::sub>::apply(0,a);
+			return a/b;
+		}
+		template<typename T>static T apply(const T& a,const T& b)
+		{
+			return a/b;
+		}
+	};
+	template<>struct binary_impl<binary_op::mod> {
+		static integer apply(integer a,integer b)
+		{
+			if(b==0)
+				throw lang_error("CSLE0018");
+			return b==-1?0:a%b;
+		}
+		static floating apply(floating a,floating b)
+		{
+			return std::fmod(a,b);
+		}
+	};
+	template<>struct binary_impl<binary_op::lt> {
+		template<typename T>static bool apply(const T& a,const T& b)
+		{
+			return a<b;
+		}
+	};
+	template<>struct binary_impl<binary_op::le> {
+		template<typename T>static bool apply(const T& a,const T& b)
+		{
+			return a<=b;
+		}
+	};
+	template<>struct binary_impl<binary_op::gt> {
+		template<typename T>static bool apply(const T& a,const T& b)
+		{
+			return a>b;
+		}
+	};
+	template<>struct binary_impl<binary_op::ge> {
+		template<typename T>static bool apply(const T& a,const T& b)
+		{
+			return a>=b;
+		}
+	};
+	template<>struct binary_impl<binary_op::eq> {
+		template<typename T>static bool apply(const T& a,const T& b)
+		{
+			return a==b;
+		}
+	};
+	template<>struct binary_impl<binary_op::ne> {
+		template<typename T>static bool apply(const T& a,const T& b)
+		{
+			return a!=b;
+		}
+	};
+	// Scalars are read by value, which a compact var needs for integers, anything else by reference
+	template<typename T>struct binary_operand {
+		static const T& get(const var& v)
+		{
+			return v.const_val<T>();
+		}
+	};
+	template<typename T>struct binary_scalar_operand {
+		static T get(const var& v)
+		{
+			return v.value<T>();
+		}
+	};
+	template<>struct binary_operand<integer>:binary_scalar_operand<integer> {};
+	template<>struct binary_operand<floating>:binary_scalar_operand<floating> {};
+	template<>struct binary_operand<boolean>:binary_scalar_operand<boolean> {};
+	template<>struct binary_operand<character>:binary_scalar_operand<character> {};
+	template<typename T>bool binary_truth(const T& val)
+	{
+		return val!=T();
+	}
+	inline bool binary_truth(const literal& val)
+	{
+		return !val.empty();
+	}
+	template<typename T>bool binary_store(var& dst,const T& val)
+	{
+		dst=val;
+		return binary_truth(val);
+	}
+	// Converts both operands to T, their common type under the promotion rules, then applies op
+	template<binary_op op,typename T,typename L,typename R>bool binary_handler_of(var& dst,const var& lhs,const var& rhs)
+	{
+		return binary_store(dst,binary_impl<op>::apply(static_cast<const T&>(binary_operand<L>::get(lhs)),static_cast<const T&>(binary_operand<R>::get(rhs))));
+	}
+	// Handlers indexed by operator, left type id and right type id. Pairs of built-in types sit in a
+	// dense matrix, pairs with a user type in a map per operator, so a late type id adds one entry
+	// instead of growing the matrix.
+	// Register handlers before any thread evaluates operators, lookups take no lock.
+	class operator_table final {
+		struct matrix final {
+			static constexpr std::size_t dim=type_ids::user;
+			std::vector<binary_handler> handlers=std::vector<binary_handler>(binary_op_count*dim*dim,nullptr);
+			std::unordered_map<std::uint64_t,binary_handler> user[binary_op_count];
+			static bool dense(type_id_t lhs,type_id_t rhs) noexcept
+			{
+				return lhs<dim&&rhs<dim;
+			}
+			static std::size_t index(binary_op op,type_id_t lhs,type_id_t rhs) noexcept
+			{
+				return (static_cast<std::size_t>(op)*dim+lhs)*dim+rhs;
+			}
+			static std::uint64_t key(type_id_t lhs,type_id_t rhs) noexcept
+			{
+				return std::uint64_t(lhs)<<32|rhs;
+			}
+			void set(binary_op op,type_id_t lhs,type_id_t rhs,binary_handler func)
+			{
+				if(dense(lhs,rhs))
+					handlers[index(op,lhs,rhs)]=func;
+				else
+					user[static_cast<std::size_t>(op)][key(lhs,rhs)]=func;
+			}
+			binary_handler get(binary_op op,type_id_t lhs,type_id_t rhs) const noexcept
+			{
+				if(dense(lhs,rhs))
+					return handlers[index(op,lhs,rhs)];
+				const std::unordered_map<std::uint64_t,binary_handler>& pairs=user[static_cast<std::size_t>(op)];
+				if(pairs.empty())
+					return nullptr;
+				auto it=pairs.find(key(lhs,rhs));
+				return it==pairs.end()?nullptr:it->second;
+			}
+			template<typename T,typename L,typename R,binary_op...ops>void set_all()
+			{
+				int expand[]= {(set(ops,type_id_of<L>(),type_id_of<R>(),&binary_handler_of<ops,T,L,R>),0)...};
+				(void)expand;
+			}
+		};
+		// Integer and floating operands mix by promoting the integer to floating
+		static matrix builtins()
+		{
+			using op=binary_op;
+			matrix m;
+			m.set_all<integer,integer,integer,op::add,op::sub,op::mul,op::div,op::mod,op::lt,op::le,op::gt,op::ge,op::eq,op::ne>();
+			m.set_all<floating,floating,floating,op::add,op::sub,op::mul,op::div,op::mod,op::lt,op::le,op::gt,op::ge,op::eq,op::ne>();
+			m.set_all<floating,integer,floating,op::add,op::sub,op::mul,op::div,op::mod,op::lt,op::le,op::gt,op::ge,op::eq,op::ne>();
+			m.set_all<floating,floating,integer,op::add,op::sub,op::mul,op::div,op::mod,op::lt,op::le,op::gt,op::ge,op::eq,op::ne>();
+			m.set_all<literal,literal,literal,op::add,op::lt,op::le,op::gt,op::ge,op::eq,op::ne>();
+			m.set_all<character,character,character,op::lt,op::le,op::gt,op::ge,op::eq,op::ne>();
+			m.set_all<boolean,boolean,boolean,op::eq,op::ne>();
+			return m;
+		}
+		static matrix& table()
+		{
+			static matrix m=builtins();
+			return m;
+		}
+	public:
+		static void add(binary_op op,type_id_t lhs,type_id_t rhs,binary_handler func)
+		{
+			table().set(op,lhs,rhs,func);
+		}
+		template<typename L,typename R>static void add(binary_op op,binary_handler func)
+		{
+			add(op,type_id_of<L>(),type_id_of<R>(),func);
+		}
+		// Null when the pair has no handler for op
+		static binary_handler get(binary_op op,type_id_t lhs,type_id_t rhs) noexcept
+		{
+			return table().get(op,lhs,rhs);
+		}
+	};
+	// eq and ne fall back to var::operator== for pairs without a handler, other operators throw
+	inline bool binary(binary_op op,var& dst,const var& lhs,const var& rhs)
+	{
+		binary_handler func=operator_table::get(op,lhs.type_id(),rhs.type_id());
+		if(func!=nullptr)
+			return func(dst,lhs,rhs);
+		if(op==binary_op::eq||op==binary_op::ne)
+			return binary_store(dst,(lhs==rhs)==(op==binary_op::eq));
+		throw lang_error("CSLE0017");
+	}
+	inline bool binary_numeric(type_id_t id) noexcept
+	{
+		return id==type_ids::integer||id==type_ids::floating;
+	}
+	inline floating binary_promote(const var& v,type_id_t id)
+	{
+		return id==type_ids::integer?floating(v.value<integer>()):v.value<floating>();
+	}
+	// A calc function for one operator, integer and floating operands skip the table
+	template<binary_op op>bool calc_binary(var& dst,const var& lhs,const var& rhs)
+	{
+		const type_id_t l=lhs.type_id(),r=rhs.type_id();
+		if(l==type_ids::integer&&r==type_ids::integer)
+			return binary_store(dst,binary_impl<op>::apply(lhs.value<integer>(),rhs.value<integer>()));
+		if(binary_numeric(l)&&binary_numeric(r))
+			return binary_store(dst,binary_impl<op>::apply(binary_promote(lhs,l),binary_promote(rhs,r)));
+		return binary(op,dst,lhs,rhs);
+	}
+	inline var binary(binary_op op,const var& lhs,const var& rhs)
+	{
+		var result;
+		binary(op,result,lhs,rhs);
+		return result;
+	}
+	inline var operator+(const var& lhs,const var& rhs)
+	{
+		return binary(binary_op::add,lhs,rhs);
+	}
+	inline var operator-(const var& lhs,const var& rhs)
+	{
+		return binary(binary_op::sub,lhs,rhs);
+	}
+	inline var operator*(const var& lhs,const var& rhs)
+	{
+		return binary(binary_op::mul,lhs,rhs);
+	}
+	inline var operator/(const var& lhs,const var& rhs)
+	{
+		return binary(binary_op::div,lhs,rhs);
+	}
+	inline var operator%(const var& lhs,const var& rhs)
+	{
+		return binary(binary_op::mod,lhs,rhs);
+	}
+	inline bool operator<(const var& lhs,const var& rhs)
+	{
+		var result;
+		return binary(binary_op::lt,result,lhs,rhs);
+	}
+	inline bool operator<=(const var& lhs,const var& rhs)
+	{
+		var result;
+		return binary(binary_op::le,result,lhs,rhs);
+	}
+	inline bool operator>(const var& lhs,const var& rhs)
+	{
+		var result;
+		return binary(binary_op::gt,result,lhs,rhs);
+	}
+	inline bool operator>=(const var& lhs,const var& rhs)
+	{
+		var result;
+		return binary(binary_op::ge,result,lhs,rhs);
+	}
 }